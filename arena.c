@@ -0,0 +1,94 @@
+#include "y3c.h"
+
+// Arena allocation.
+//
+// Tokens, nodes, variables and types are allocated with arena_calloc(). By
+// default that is plain calloc() and nothing is freed. While a thread has an
+// arena in use, they come from the arena instead, and are all freed at once
+// with it. Streaming compilation uses this to free each function as soon as
+// it has been emitted.
+
+// Chunks start small, since most arenas hold a single function, and double
+// up to the maximum size.
+#define ARENA_MIN_CHUNK_SIZE 1024
+#define ARENA_MAX_CHUNK_SIZE (64 * 1024)
+
+typedef struct Chunk Chunk;
+struct Chunk {
+    Chunk *next;
+    size_t used;
+    size_t size;
+    _Alignas(16) char data[];
+};
+
+struct Arena {
+    Chunk *chunks;
+};
+
+static _Thread_local Arena *current_arena;
+
+Arena *new_arena(void) {
+    return calloc(1, sizeof(Arena));
+}
+
+void free_arena(Arena *arena) {
+    Chunk *next;
+    for (Chunk *c = arena->chunks; c; c = next) {
+        next = c->next;
+        free(c);
+    }
+    free(arena);
+}
+
+// Frees everything allocated from |arena| but keeps its newest, and
+// largest, chunk, so that a long-lived thread can reuse the arena without
+// going back to malloc() each time.
+void reset_arena(Arena *arena) {
+    Chunk *keep = arena->chunks;
+    if (!keep) {
+        return;
+    }
+    Chunk *next;
+    for (Chunk *c = keep->next; c; c = next) {
+        next = c->next;
+        free(c);
+    }
+    keep->next = NULL;
+    memset(keep->data, 0, keep->used);
+    keep->used = 0;
+}
+
+// Makes this thread allocate from |arena|, or with calloc() if it is NULL.
+// Returns the arena in use before.
+Arena *use_arena(Arena *arena) {
+    Arena *prev = current_arena;
+    current_arena = arena;
+    return prev;
+}
+
+void *arena_calloc(size_t nmemb, size_t size) {
+    count_allocation(nmemb * size);
+    Arena *arena = current_arena;
+    if (!arena) {
+        return calloc(nmemb, size);
+    }
+
+    size_t len = (nmemb * size + 15) / 16 * 16;
+    Chunk *c = arena->chunks;
+    if (!c || c->size - c->used < len) {
+        size_t chunk_size = c ? c->size * 2 : ARENA_MIN_CHUNK_SIZE;
+        if (chunk_size > ARENA_MAX_CHUNK_SIZE) {
+            chunk_size = ARENA_MAX_CHUNK_SIZE;
+        }
+        if (chunk_size < len) {
+            chunk_size = len;
+        }
+        c = calloc(1, sizeof(Chunk) + chunk_size);
+        c->size = chunk_size;
+        c->next = arena->chunks;
+        arena->chunks = c;
+    }
+    void *p = c->data + c->used;
+    c->used += len;
+    return p;
+}
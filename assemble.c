@@ -0,0 +1,1308 @@
+#include "y3c.h"
+
+#include <elf.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Built-in assembler.
+//
+// Encodes the Intel-syntax assembly that codegen emits into x86-64 machine
+// code and writes it out as an ELF64 relocatable object, so that no
+// external assembler is needed. Only the instructions and operand forms
+// that codegen actually produces are supported. Jumps always use 32-bit
+// displacements, and calls are left to the linker as R_X86_64_PLT32
+// relocations. Global variables go into .data, .bss and .rodata, and
+// RIP-relative operands that refer to them become R_X86_64_PC32
+// relocations against those sections. The ".long a - b" entries of jump
+// tables may only refer to labels in the same section.
+
+typedef enum { OPND_REG, OPND_MEM, OPND_IMM, OPND_SYM } OperandKind;
+
+// The base register of [rip+label] operands.
+#define REG_RIP 16
+
+typedef struct Operand Operand;
+struct Operand {
+    OperandKind kind;
+    int size;       // 1, 2, 4 or 8, or 16 and 32 for xmm and ymm registers
+
+    // Register
+    int reg;
+    bool needs_rex; // spl, bpl, sil and dil are only reachable with REX
+
+    // Memory: [base + index * scale + disp], or [rip + sym + disp]
+    int base;
+    int index;      // -1 if none
+    int scale;
+    long disp;
+
+    long imm;
+    char *sym;
+};
+
+// The sections that code and data are assembled into.
+typedef enum {
+    SECTION_TEXT,
+    SECTION_DATA,
+    SECTION_BSS,
+    SECTION_RODATA,
+    NSECTION_KINDS,
+} SectionKind;
+
+typedef struct Section Section;
+struct Section {
+    unsigned char *data;  // All zeros for .bss, which is not written out
+    int len;
+    int cap;
+    int align;
+};
+
+typedef struct Label Label;
+struct Label {
+    Label *next;
+    char *name;
+    SectionKind section;
+    int offset;
+    bool is_global;
+    bool is_defined;
+    int sym_index;
+};
+
+// A 32-bit field at |offset| holding |label| + |addend| relative to the
+// end of the field, or to |base| if it is set.
+typedef struct Fixup Fixup;
+struct Fixup {
+    Fixup *next;
+    SectionKind section;
+    int offset;
+    Label *label;
+    Label *base;
+    long addend;
+    bool is_call;
+};
+
+static _Thread_local Section sections[NSECTION_KINDS];
+// The section being assembled into.
+static _Thread_local SectionKind current_section;
+static _Thread_local Label *labels;
+static _Thread_local Fixup *fixups;
+// The RIP-relative field of the instruction being assembled, if any. The
+// CPU takes it relative to the end of the instruction rather than of the
+// field.
+static _Thread_local Fixup *rip_fixup;
+static _Thread_local int lineno;
+
+static void asm_error(char *fmt, ...) {
+    char msg[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    error("assembler: line %d: %s", lineno, msg);
+}
+
+static void emit_byte(int b) {
+    Section *sec = &sections[current_section];
+    if (sec->len == sec->cap) {
+        sec->cap = sec->cap ? sec->cap * 2 : 4096;
+        sec->data = realloc(sec->data, sec->cap);
+    }
+    sec->data[sec->len++] = b;
+}
+
+// Returns the offset of the next byte in the current section.
+static int current_offset(void) {
+    return sections[current_section].len;
+}
+
+static void emit_bytes(long val, int n) {
+    for (int i = 0; i < n; ++i) {
+        emit_byte((val >> (8 * i)) & 0xff);
+    }
+}
+
+static Label *find_label(char *name) {
+    for (Label *l = labels; l; l = l->next) {
+        if (!strcmp(l->name, name)) {
+            return l;
+        }
+    }
+    Label *l = calloc(1, sizeof(Label));
+    l->name = strdup(name);
+    l->next = labels;
+    labels = l;
+    return l;
+}
+
+//
+// Operand parsing
+//
+
+static int parse_reg(char *s, int *size, bool *needs_rex) {
+    static char *r64[] = {
+        "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+    };
+    static char *r32[] = {
+        "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+        "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
+    };
+    static char *r16[] = {
+        "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+        "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w",
+    };
+    static char *r8[] = {
+        "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+        "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+    };
+
+    *needs_rex = false;
+    for (int i = 0; i < 16; ++i) {
+        if (!strcmp(s, r64[i])) {
+            *size = 8;
+            return i;
+        }
+        if (!strcmp(s, r32[i])) {
+            *size = 4;
+            return i;
+        }
+        if (!strcmp(s, r16[i])) {
+            *size = 2;
+            return i;
+        }
+        if (!strcmp(s, r8[i])) {
+            *size = 1;
+            *needs_rex = 4 <= i && i < 8;
+            return i;
+        }
+    }
+    if (!strncmp(s, "xmm", 3) || !strncmp(s, "ymm", 3)) {
+        char *end;
+        long n = strtol(s + 3, &end, 10);
+        if (end != s + 3 && !*end && 0 <= n && n < 16) {
+            *size = s[0] == 'x' ? 16 : 32;
+            return n;
+        }
+    }
+    return -1;
+}
+
+static char *trim(char *s) {
+    while (isspace(*s)) {
+        s++;
+    }
+    char *end = s + strlen(s);
+    while (end > s && isspace(end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+static void parse_mem(char *s, Operand *op) {
+    op->kind = OPND_MEM;
+    op->base = -1;
+    op->index = -1;
+    op->scale = 1;
+    op->disp = 0;
+
+    // Terms are cut out of |s| in place, so that symbols stay valid.
+    char *p = s;
+    int sign = 1;
+    while (*p) {
+        char *term = p;
+        while (*p && *p != '+' && *p != '-') {
+            p++;
+        }
+        char sep = *p;
+        *p = '\0';
+
+        char *star = strchr(term, '*');
+        if (star) {
+            *star = '\0';
+        }
+        term = trim(term);
+        int size;
+        bool needs_rex;
+        int r = parse_reg(term, &size, &needs_rex);
+        if (!strcmp(term, "rip")) {
+            op->base = REG_RIP;
+        }
+        // The name after rip+ is a symbol, even if it is one like di.
+        else if (op->base == REG_RIP && !op->sym && sign > 0
+            && !isdigit(*term)) {
+            op->sym = term;
+        }
+        else if (r >= 0) {
+            if (size != 8 || sign < 0) {
+                asm_error("invalid memory operand: [%s]", s);
+            }
+            if (star || op->base >= 0) {
+                op->index = r;
+                op->scale = star ? atoi(star + 1) : 1;
+            }
+            else {
+                op->base = r;
+            }
+        }
+        else if (isdigit(*term)) {
+            op->disp += sign * strtol(term, NULL, 0);
+        }
+        else if (!op->sym && sign > 0) {
+            op->sym = term;
+        }
+        else {
+            asm_error("invalid memory operand: %s", term);
+        }
+
+        if (sep) {
+            sign = sep == '-' ? -1 : 1;
+            p++;
+        }
+    }
+    if (op->base < 0 || op->index == 4
+        || (op->base == REG_RIP) != (op->sym != NULL)
+        || (op->base == REG_RIP && op->index >= 0)) {
+        asm_error("unsupported memory operand");
+    }
+}
+
+static void parse_operand(char *s, Operand *op) {
+    memset(op, 0, sizeof(*op));
+    s = trim(s);
+
+    // Optional size qualifier, e.g. "dword ptr [rbp-8]".
+    static char *sizes[] = { "byte", "word", "dword", "qword" };
+    for (int i = 0; i < 4; ++i) {
+        int n = strlen(sizes[i]);
+        if (!strncmp(s, sizes[i], n) && isspace(s[n])) {
+            op->size = 1 << i;
+            s = trim(s + n);
+            if (strncmp(s, "ptr", 3)) {
+                asm_error("expected 'ptr': %s", s);
+            }
+            s = trim(s + 3);
+            break;
+        }
+    }
+
+    if (*s == '[') {
+        char *end = strchr(s, ']');
+        if (!end) {
+            asm_error("expected ']': %s", s);
+        }
+        *end = '\0';
+        int size = op->size;
+        parse_mem(s + 1, op);
+        op->size = size;
+        return;
+    }
+
+    int r = parse_reg(s, &op->size, &op->needs_rex);
+    if (r >= 0) {
+        op->kind = OPND_REG;
+        op->reg = r;
+        return;
+    }
+
+    if (isdigit(*s) || *s == '-') {
+        op->kind = OPND_IMM;
+        op->imm = strtoll(s, NULL, 0);
+        return;
+    }
+
+    op->kind = OPND_SYM;
+    op->sym = s;
+}
+
+//
+// Encoding
+//
+
+static bool is_reg(Operand *op) {
+    return op->kind == OPND_REG;
+}
+
+static bool is_rm(Operand *op) {
+    return op->kind == OPND_REG || op->kind == OPND_MEM;
+}
+
+static bool fits_int8(long val) {
+    return -128 <= val && val <= 127;
+}
+
+static bool fits_int32(long val) {
+    return INT32_MIN <= val && val <= INT32_MAX;
+}
+
+static int rex_bits(int reg, Operand *rm) {
+    int rex = (reg >> 3 & 1) << 2;
+    if (rm->kind == OPND_REG) {
+        rex |= rm->reg >> 3 & 1;
+    }
+    else {
+        if (rm->index >= 0) {
+            rex |= (rm->index >> 3 & 1) << 1;
+        }
+        rex |= rm->base >> 3 & 1;
+    }
+    return rex;
+}
+
+static Fixup *emit_rel32(char *name, bool is_call) {
+    Fixup *f = calloc(1, sizeof(Fixup));
+    f->section = current_section;
+    f->offset = current_offset();
+    f->label = find_label(name);
+    f->is_call = is_call;
+    f->next = fixups;
+    fixups = f;
+    emit_bytes(0, 4);
+    return f;
+}
+
+static void emit_modrm(int reg, Operand *rm) {
+    reg &= 7;
+    if (rm->kind == OPND_REG) {
+        emit_byte(0xc0 | reg << 3 | (rm->reg & 7));
+        return;
+    }
+    if (rm->base == REG_RIP) {
+        emit_byte(reg << 3 | 5);
+        rip_fixup = emit_rel32(rm->sym, false);
+        rip_fixup->addend = rm->disp;
+        return;
+    }
+
+    int base = rm->base & 7;
+    int mod;
+    if (rm->disp == 0 && base != 5) {
+        mod = 0;
+    }
+    else if (fits_int8(rm->disp)) {
+        mod = 1;
+    }
+    else {
+        mod = 2;
+    }
+
+    if (rm->index >= 0 || base == 4) {
+        static int scale_bits[] = { 0, 0, 1, 0, 2, 0, 0, 0, 3 };
+        int index = rm->index >= 0 ? rm->index & 7 : 4;
+        emit_byte(mod << 6 | reg << 3 | 4);
+        emit_byte(scale_bits[rm->scale] << 6 | index << 3 | base);
+    }
+    else {
+        emit_byte(mod << 6 | reg << 3 | base);
+    }
+
+    if (mod == 1) {
+        emit_bytes(rm->disp, 1);
+    }
+    else if (mod == 2) {
+        emit_bytes(rm->disp, 4);
+    }
+}
+
+// Emits |prefix| (if non-zero), a REX prefix if needed, the |len| bytes of
+// |opcode| and a ModRM for |reg| and |rm|. |size| is the operand size.
+static void encode(int prefix, int size, bool force_rex, int opcode, int len,
+    int reg, Operand *rm) {
+
+    if (size == 2) {
+        emit_byte(0x66);
+    }
+    if (prefix) {
+        emit_byte(prefix);
+    }
+    int rex = rex_bits(reg, rm) | (size == 8) << 3;
+    if (rex || force_rex || (rm->kind == OPND_REG && rm->needs_rex)) {
+        emit_byte(0x40 | rex);
+    }
+    for (int i = len - 1; i >= 0; --i) {
+        emit_byte(opcode >> (8 * i) & 0xff);
+    }
+    emit_modrm(reg, rm);
+}
+
+// Emits a VEX-encoded instruction. |pp| selects the implied 66/F3/F2 prefix
+// and |map| the 0F/0F38/0F3A opcode map.
+static void encode_vex(int pp, int map, bool w, int size, int vvvv,
+    int opcode, int reg, Operand *rm) {
+
+    int rex = rex_bits(reg, rm);
+    int l = size == 32;
+    if (map == 1 && !w && !(rex & 3)) {
+        emit_byte(0xc5);
+        emit_byte((~rex & 4) << 5 | (~vvvv & 15) << 3 | l << 2 | pp);
+    }
+    else {
+        emit_byte(0xc4);
+        emit_byte((~rex & 7) << 5 | map);
+        emit_byte(w << 7 | (~vvvv & 15) << 3 | l << 2 | pp);
+    }
+    emit_byte(opcode);
+    emit_modrm(reg, rm);
+}
+
+static int condition_code(char *cc) {
+    static char *names[] = {
+        "o", "no", "b", "ae", "e", "ne", "be", "a",
+        "s", "ns", "p", "np", "l", "ge", "le", "g",
+    };
+    for (int i = 0; i < 16; ++i) {
+        if (!strcmp(cc, names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void bad_operands(char *mnemonic) {
+    asm_error("unsupported operands for '%s'", mnemonic);
+}
+
+static void assemble_alu(char *m, int digit, Operand *ops, int nops) {
+    if (nops != 2) {
+        bad_operands(m);
+    }
+    Operand *dst = &ops[0];
+    Operand *src = &ops[1];
+    int size = dst->size ? dst->size : src->size;
+    int base = digit << 3;
+    int byte = size == 1 ? 0 : 1;
+
+    if (is_rm(dst) && is_reg(src)) {
+        encode(0, size, src->needs_rex, base | byte, 1, src->reg, dst);
+    }
+    else if (is_reg(dst) && src->kind == OPND_MEM) {
+        encode(0, size, dst->needs_rex, base | 2 | byte, 1, dst->reg, src);
+    }
+    else if (is_rm(dst) && src->kind == OPND_IMM) {
+        if (size == 1) {
+            encode(0, size, false, 0x80, 1, digit, dst);
+            emit_bytes(src->imm, 1);
+        }
+        else if (fits_int8(src->imm)) {
+            encode(0, size, false, 0x83, 1, digit, dst);
+            emit_bytes(src->imm, 1);
+        }
+        else {
+            encode(0, size, false, 0x81, 1, digit, dst);
+            emit_bytes(src->imm, size == 2 ? 2 : 4);
+        }
+    }
+    else {
+        bad_operands(m);
+    }
+}
+
+static void assemble_instruction(char *m, Operand *ops, int nops) {
+    static char *alu[] = {
+        "add", "or", "adc", "sbb", "and", "sub", "xor", "cmp",
+    };
+    for (int i = 0; i < 8; ++i) {
+        if (!strcmp(m, alu[i])) {
+            assemble_alu(m, i, ops, nops);
+            return;
+        }
+    }
+
+    Operand *a = &ops[0];
+    Operand *b = &ops[1];
+
+    if (!strcmp(m, "mov") && nops == 2) {
+        int size = a->size ? a->size : b->size;
+        if (is_rm(a) && is_reg(b)) {
+            int opcode = size == 1 ? 0x88 : 0x89;
+            encode(0, size, b->needs_rex, opcode, 1, b->reg, a);
+        }
+        else if (is_reg(a) && b->kind == OPND_MEM) {
+            int opcode = size == 1 ? 0x8a : 0x8b;
+            encode(0, size, a->needs_rex, opcode, 1, a->reg, b);
+        }
+        else if (is_reg(a) && b->kind == OPND_IMM && size == 8
+            && !fits_int32(b->imm)) {
+            // movabs
+            emit_byte(0x48 | (a->reg >> 3));
+            emit_byte(0xb8 + (a->reg & 7));
+            emit_bytes(b->imm, 8);
+        }
+        else if (is_rm(a) && b->kind == OPND_IMM) {
+            int opcode = size == 1 ? 0xc6 : 0xc7;
+            encode(0, size, a->needs_rex, opcode, 1, 0, a);
+            emit_bytes(b->imm, size < 4 ? size : 4);
+        }
+        else {
+            bad_operands(m);
+        }
+        return;
+    }
+
+    if (!strcmp(m, "lea") && nops == 2 && is_reg(a) && b->kind == OPND_MEM) {
+        encode(0, a->size, false, 0x8d, 1, a->reg, b);
+        return;
+    }
+
+    if ((!strcmp(m, "movzx") || !strcmp(m, "movsx")) && nops == 2
+        && is_reg(a) && is_rm(b) && (b->size == 1 || b->size == 2)) {
+        int opcode = (m[3] == 'z' ? 0x0fb6 : 0x0fbe) | (b->size == 2);
+        encode(0, a->size, b->needs_rex, opcode, 2, a->reg, b);
+        return;
+    }
+
+    if (!strcmp(m, "movsxd") && nops == 2 && is_reg(a) && is_rm(b)) {
+        encode(0, 8, false, 0x63, 1, a->reg, b);
+        return;
+    }
+
+    if (!strcmp(m, "imul")) {
+        if (nops == 1 && is_rm(a)) {
+            encode(0, a->size, false, 0xf7, 1, 5, a);
+        }
+        else if (nops == 2 && is_reg(a) && is_rm(b)) {
+            encode(0, a->size, false, 0x0faf, 2, a->reg, b);
+        }
+        else if (nops == 3 && is_reg(a) && is_rm(b)
+            && ops[2].kind == OPND_IMM) {
+            bool short_imm = fits_int8(ops[2].imm);
+            encode(0, a->size, false, short_imm ? 0x6b : 0x69, 1, a->reg, b);
+            emit_bytes(ops[2].imm, short_imm ? 1 : 4);
+        }
+        else {
+            bad_operands(m);
+        }
+        return;
+    }
+
+    static char *unary[] = { "not", "neg", "mul", NULL, "div", "idiv" };
+    for (int i = 0; i < 6; ++i) {
+        if (unary[i] && !strcmp(m, unary[i])) {
+            if (nops != 1 || !is_rm(a)) {
+                bad_operands(m);
+            }
+            encode(0, a->size, false, 0xf7, 1, i + 2, a);
+            return;
+        }
+    }
+
+    static char *shifts[] = { "rol", "ror", "rcl", "rcr", "shl", "shr", NULL,
+        "sar" };
+    for (int i = 0; i < 8; ++i) {
+        if (shifts[i] && !strcmp(m, shifts[i])) {
+            if (nops != 2 || !is_rm(a) || b->kind != OPND_IMM) {
+                bad_operands(m);
+            }
+            encode(0, a->size, false, 0xc1, 1, i, a);
+            emit_bytes(b->imm, 1);
+            return;
+        }
+    }
+
+    if ((!strcmp(m, "push") || !strcmp(m, "pop")) && nops == 1 && is_reg(a)) {
+        if (a->reg >= 8) {
+            emit_byte(0x41);
+        }
+        emit_byte((m[1] == 'u' ? 0x50 : 0x58) + (a->reg & 7));
+        return;
+    }
+
+    if (!strcmp(m, "cqo") && nops == 0) {
+        emit_byte(0x48);
+        emit_byte(0x99);
+        return;
+    }
+
+    // stos and movs with a b, w, d or q suffix for the element size.
+    if ((!strncmp(m, "stos", 4) || !strncmp(m, "movs", 4)) && m[4]
+        && strchr("bwdq", m[4]) && !m[5] && nops == 0) {
+        if (m[4] == 'w') {
+            emit_byte(0x66);
+        }
+        if (m[4] == 'q') {
+            emit_byte(0x48);
+        }
+        emit_byte((m[0] == 's' ? 0xaa : 0xa4) + (m[4] != 'b'));
+        return;
+    }
+
+    if (!strcmp(m, "ret") && nops == 0) {
+        emit_byte(0xc3);
+        return;
+    }
+
+    if (!strncmp(m, "set", 3) && condition_code(m + 3) >= 0 && nops == 1
+        && is_rm(a)) {
+        encode(0, 1, false, 0x0f90 | condition_code(m + 3), 2, 0, a);
+        return;
+    }
+
+    if (!strcmp(m, "jmp") && nops == 1 && a->kind == OPND_SYM) {
+        emit_byte(0xe9);
+        emit_rel32(a->sym, false);
+        return;
+    }
+
+    if (!strcmp(m, "jmp") && nops == 1 && is_reg(a) && a->size == 8) {
+        encode(0, 4, false, 0xff, 1, 4, a);
+        return;
+    }
+
+    if (m[0] == 'j' && condition_code(m + 1) >= 0 && nops == 1
+        && a->kind == OPND_SYM) {
+        emit_byte(0x0f);
+        emit_byte(0x80 | condition_code(m + 1));
+        emit_rel32(a->sym, false);
+        return;
+    }
+
+    if (!strcmp(m, "call") && nops == 1 && a->kind == OPND_SYM) {
+        emit_byte(0xe8);
+        emit_rel32(a->sym, true);
+        return;
+    }
+
+    //
+    // SSE2
+    //
+
+    if ((!strcmp(m, "movdqu") || !strcmp(m, "movdqa")) && nops == 2) {
+        int prefix = m[5] == 'u' ? 0xf3 : 0x66;
+        if (is_reg(a) && is_rm(b)) {
+            encode(prefix, 0, false, 0x0f6f, 2, a->reg, b);
+        }
+        else if (a->kind == OPND_MEM && is_reg(b)) {
+            encode(prefix, 0, false, 0x0f7f, 2, b->reg, a);
+        }
+        else {
+            bad_operands(m);
+        }
+        return;
+    }
+
+    // Packed integer arithmetic, as "op xmm, xmm/m128".
+    static struct { char *name; int opcode; } packed[] = {
+        { "paddb", 0xfc }, { "paddw", 0xfd }, { "paddd", 0xfe },
+        { "paddq", 0xd4 }, { "psubb", 0xf8 }, { "psubw", 0xf9 },
+        { "psubd", 0xfa }, { "psubq", 0xfb }, { "pxor", 0xef },
+    };
+    for (int i = 0; i < (int)(sizeof(packed) / sizeof(*packed)); ++i) {
+        if (!strcmp(m, packed[i].name)) {
+            if (nops != 2 || !is_reg(a) || !is_rm(b)) {
+                bad_operands(m);
+            }
+            encode(0x66, 0, false, 0x0f00 | packed[i].opcode, 2, a->reg, b);
+            return;
+        }
+        // The AVX forms take an extra source: "vop dst, src1, src2".
+        if (m[0] == 'v' && !strcmp(m + 1, packed[i].name)) {
+            if (nops != 3 || !is_reg(a) || !is_reg(b) || !is_rm(&ops[2])) {
+                bad_operands(m);
+            }
+            encode_vex(1, 1, false, a->size, b->reg, packed[i].opcode,
+                a->reg, &ops[2]);
+            return;
+        }
+    }
+
+    if (!strcmp(m, "psrldq") && nops == 2 && is_reg(a)
+        && b->kind == OPND_IMM) {
+        encode(0x66, 0, false, 0x0f73, 2, 3, a);
+        emit_bytes(b->imm, 1);
+        return;
+    }
+
+    if (!strcmp(m, "movq") && nops == 2 && is_reg(a) && a->size == 8
+        && is_reg(b) && b->size == 16) {
+        encode(0x66, 8, false, 0x0f7e, 2, b->reg, a);
+        return;
+    }
+
+    //
+    // AVX2
+    //
+
+    if (!strcmp(m, "vmovdqu") && nops == 2) {
+        if (is_reg(a) && is_rm(b)) {
+            encode_vex(2, 1, false, a->size, 0, 0x6f, a->reg, b);
+        }
+        else if (a->kind == OPND_MEM && is_reg(b)) {
+            encode_vex(2, 1, false, b->size, 0, 0x7f, b->reg, a);
+        }
+        else {
+            bad_operands(m);
+        }
+        return;
+    }
+
+    if (!strcmp(m, "vextracti128") && nops == 3 && is_rm(a) && is_reg(b)
+        && ops[2].kind == OPND_IMM) {
+        encode_vex(1, 3, false, 32, 0, 0x39, b->reg, a);
+        emit_bytes(ops[2].imm, 1);
+        return;
+    }
+
+    if (!strcmp(m, "vzeroupper") && nops == 0) {
+        emit_byte(0xc5);
+        emit_byte(0xf8);
+        emit_byte(0x77);
+        return;
+    }
+
+    asm_error("unsupported instruction: %s", m);
+}
+
+// Emits the |size|-byte value |s| of a ".byte", ".short", ".long" or
+// ".quad". It is a number, or for ".long" the difference of two labels.
+static void assemble_value(char *s, int size) {
+    if (isdigit(*s) || *s == '-') {
+        emit_bytes(strtol(s, NULL, 0), size);
+        return;
+    }
+    char *minus = strchr(s, '-');
+    if (!minus || size != 4) {
+        asm_error("unsupported value: %s", s);
+    }
+    *minus = '\0';
+    emit_rel32(trim(s), false)->base = find_label(trim(minus + 1));
+}
+
+// Pads the current section to a multiple of |align| bytes.
+static void assemble_align(int align) {
+    if (align <= 0 || (align & (align - 1))) {
+        asm_error("invalid alignment: %d", align);
+    }
+    Section *sec = &sections[current_section];
+    if (sec->align < align) {
+        sec->align = align;
+    }
+    while (current_offset() % align) {
+        emit_byte(0);
+    }
+}
+
+// Switches to the section named by a ".text", ".data", ".bss" or
+// ".section" directive, and returns false for any other directive.
+static bool assemble_section(char *line) {
+    static struct {
+        char *directive;
+        SectionKind section;
+    } names[] = {
+        { ".text", SECTION_TEXT },
+        { ".data", SECTION_DATA },
+        { ".bss", SECTION_BSS },
+        { ".section .rodata", SECTION_RODATA },
+    };
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(*names)); ++i) {
+        if (!strcmp(line, names[i].directive)) {
+            current_section = names[i].section;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void assemble_line(char *line) {
+    line = trim(line);
+    if (!*line) {
+        return;
+    }
+
+    // Label
+    int len = strlen(line);
+    if (line[len - 1] == ':') {
+        line[len - 1] = '\0';
+        Label *l = find_label(line);
+        if (l->is_defined) {
+            asm_error("duplicate label: %s", line);
+        }
+        l->is_defined = true;
+        l->section = current_section;
+        l->offset = current_offset();
+        return;
+    }
+
+    // Directive
+    if (line[0] == '.') {
+        if (!strncmp(line, ".global", 7) && isspace(line[7])) {
+            find_label(trim(line + 7))->is_global = true;
+            return;
+        }
+        if (!strcmp(line, ".intel_syntax noprefix")
+            || assemble_section(line)) {
+            return;
+        }
+        static char *values[] = { ".byte", ".short", ".long", ".quad" };
+        for (int i = 0; i < 4; ++i) {
+            int n = strlen(values[i]);
+            if (!strncmp(line, values[i], n) && isspace(line[n])) {
+                assemble_value(trim(line + n), 1 << i);
+                return;
+            }
+        }
+        if (!strncmp(line, ".zero", 5) && isspace(line[5])) {
+            for (int n = atoi(trim(line + 5)); n > 0; --n) {
+                emit_byte(0);
+            }
+            return;
+        }
+        if (!strncmp(line, ".align", 6) && isspace(line[6])) {
+            assemble_align(atoi(trim(line + 6)));
+            return;
+        }
+        // Object files get no debug information, so line tables are
+        // dropped.
+        if ((!strncmp(line, ".file", 5) && isspace(line[5]))
+            || (!strncmp(line, ".loc", 4) && isspace(line[4]))) {
+            return;
+        }
+        asm_error("unsupported directive: %s", line);
+    }
+
+    // Instruction
+    char *m = line;
+    while (*line && !isspace(*line)) {
+        line++;
+    }
+    if (*line) {
+        *line++ = '\0';
+    }
+    // rep prefixes the string instruction that follows it.
+    if (!strcmp(m, "rep")) {
+        emit_byte(0xf3);
+        m = trim(line);
+        line = m;
+        while (*line && !isspace(*line)) {
+            line++;
+        }
+        if (*line) {
+            *line++ = '\0';
+        }
+    }
+
+    Operand ops[3];
+    int nops = 0;
+    while (*trim(line)) {
+        if (nops == 3) {
+            asm_error("too many operands");
+        }
+        char *comma = strchr(line, ',');
+        if (comma) {
+            *comma = '\0';
+        }
+        parse_operand(line, &ops[nops++]);
+        if (!comma) {
+            break;
+        }
+        line = comma + 1;
+    }
+    rip_fixup = NULL;
+    assemble_instruction(m, ops, nops);
+    if (rip_fixup) {
+        rip_fixup->addend -= current_offset() - (rip_fixup->offset + 4);
+    }
+}
+
+//
+// ELF writer
+//
+
+typedef struct Buffer Buffer;
+struct Buffer {
+    char *data;
+    size_t len;
+    FILE *fp;
+};
+
+static void open_buffer(Buffer *buf) {
+    buf->fp = open_memstream(&buf->data, &buf->len);
+}
+
+static void close_buffer(Buffer *buf) {
+    fclose(buf->fp);
+}
+
+// Appends |s| to the string table |buf| and returns its offset.
+static int add_string(Buffer *buf, char *s) {
+    int offset = ftell(buf->fp);
+    fwrite(s, strlen(s) + 1, 1, buf->fp);
+    return offset;
+}
+
+// Points the rel32 field of |f| at its label, with each section laid out
+// at the address in |bases|.
+static void patch_rel32(Fixup *f, long *bases) {
+    if (!f->label->is_defined) {
+        error("assembler: undefined label: %s", f->label->name);
+    }
+    if (f->base && !f->base->is_defined) {
+        error("assembler: undefined label: %s", f->base->name);
+    }
+    long from = f->base ? bases[f->base->section] + f->base->offset
+        : bases[f->section] + f->offset + 4;
+    long rel = bases[f->label->section] + f->label->offset + f->addend - from;
+    unsigned char *field = sections[f->section].data + f->offset;
+    for (int i = 0; i < 4; ++i) {
+        field[i] = (rel >> (8 * i)) & 0xff;
+    }
+}
+
+static bool is_local_label(Label *l) {
+    return !strncmp(l->name, ".L", 2);
+}
+
+static void write_object(FILE *out) {
+    enum { SEC_TEXT = 1, SEC_RELA, SEC_DATA, SEC_BSS, SEC_RODATA, SEC_SYMTAB,
+        SEC_STRTAB, SEC_SHSTRTAB, SEC_NOTE, NSECTIONS };
+    static struct {
+        char *name;
+        int index;
+        int type;
+        int flags;
+    } info[] = {
+        [SECTION_TEXT] = { ".text", SEC_TEXT, SHT_PROGBITS,
+            SHF_ALLOC | SHF_EXECINSTR },
+        [SECTION_DATA] = { ".data", SEC_DATA, SHT_PROGBITS,
+            SHF_ALLOC | SHF_WRITE },
+        [SECTION_BSS] = { ".bss", SEC_BSS, SHT_NOBITS, SHF_ALLOC | SHF_WRITE },
+        [SECTION_RODATA] = { ".rodata", SEC_RODATA, SHT_PROGBITS, SHF_ALLOC },
+    };
+
+    // Symbols: the null symbol, the sections, local function labels, then
+    // globals and undefined functions.
+    Buffer strtab, symtab, rela;
+    open_buffer(&strtab);
+    open_buffer(&symtab);
+    open_buffer(&rela);
+    add_string(&strtab, "");
+
+    Elf64_Sym null_sym = {0};
+    fwrite(&null_sym, sizeof(null_sym), 1, symtab.fp);
+    int nsyms = 1;
+    int section_sym[NSECTION_KINDS];
+    for (int i = 0; i < NSECTION_KINDS; ++i) {
+        Elf64_Sym sym = {0};
+        sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+        sym.st_shndx = info[i].index;
+        fwrite(&sym, sizeof(sym), 1, symtab.fp);
+        section_sym[i] = nsyms++;
+    }
+    int first_global = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            first_global = nsyms;
+        }
+        for (Label *l = labels; l; l = l->next) {
+            if (is_local_label(l)) {
+                continue;
+            }
+            bool is_global = l->is_global || !l->is_defined;
+            if (is_global != (pass == 1)) {
+                continue;
+            }
+            Elf64_Sym sym = {0};
+            sym.st_name = add_string(&strtab, l->name);
+            if (l->is_defined) {
+                int type = l->section == SECTION_TEXT ? STT_FUNC : STT_OBJECT;
+                sym.st_info = ELF64_ST_INFO(
+                    is_global ? STB_GLOBAL : STB_LOCAL, type);
+                sym.st_shndx = info[l->section].index;
+                sym.st_value = l->offset;
+            }
+            else {
+                sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+                sym.st_shndx = SHN_UNDEF;
+            }
+            fwrite(&sym, sizeof(sym), 1, symtab.fp);
+            l->sym_index = nsyms++;
+        }
+    }
+
+    // Resolve references within a section, and leave calls and references
+    // to other sections to the linker.
+    long bases[NSECTION_KINDS] = {0};
+    for (Fixup *f = fixups; f; f = f->next) {
+        Label *l = f->label;
+        if (f->section != SECTION_TEXT && (f->is_call
+            || (l->is_defined && l->section != f->section))) {
+            error("assembler: unsupported reference to %s outside .text",
+                l->name);
+        }
+        if (f->is_call) {
+            Elf64_Rela r = {0};
+            r.r_offset = f->offset;
+            r.r_info = ELF64_R_INFO(l->sym_index, R_X86_64_PLT32);
+            r.r_addend = -4;
+            fwrite(&r, sizeof(r), 1, rela.fp);
+            continue;
+        }
+        if (l->is_defined && l->section != f->section && !f->base) {
+            Elf64_Rela r = {0};
+            r.r_offset = f->offset;
+            r.r_info = ELF64_R_INFO(section_sym[l->section], R_X86_64_PC32);
+            r.r_addend = l->offset + f->addend - 4;
+            fwrite(&r, sizeof(r), 1, rela.fp);
+            continue;
+        }
+        if (f->base && (l->section != f->section
+            || f->base->section != f->section)) {
+            error("assembler: %s - %s spans sections", l->name,
+                f->base->name);
+        }
+        patch_rel32(f, bases);
+    }
+
+    Buffer shstrtab;
+    open_buffer(&shstrtab);
+    add_string(&shstrtab, "");
+    int names[NSECTION_KINDS];
+    for (int i = 0; i < NSECTION_KINDS; ++i) {
+        names[i] = add_string(&shstrtab, info[i].name);
+    }
+    int name_rela = add_string(&shstrtab, ".rela.text");
+    int name_symtab = add_string(&shstrtab, ".symtab");
+    int name_strtab = add_string(&shstrtab, ".strtab");
+    int name_shstrtab = add_string(&shstrtab, ".shstrtab");
+    int name_note = add_string(&shstrtab, ".note.GNU-stack");
+
+    close_buffer(&strtab);
+    close_buffer(&symtab);
+    close_buffer(&rela);
+    close_buffer(&shstrtab);
+
+    Elf64_Shdr sh[NSECTIONS] = {0};
+    size_t offset = sizeof(Elf64_Ehdr);
+
+    for (int i = 0; i < NSECTION_KINDS; ++i) {
+        Section *sec = &sections[i];
+        offset = (offset + sec->align - 1) / sec->align * sec->align;
+        sh[info[i].index] = (Elf64_Shdr) {
+            .sh_name = names[i], .sh_type = info[i].type,
+            .sh_flags = info[i].flags, .sh_offset = offset,
+            .sh_size = sec->len, .sh_addralign = sec->align,
+        };
+        if (info[i].type != SHT_NOBITS) {
+            offset += sec->len;
+        }
+    }
+
+    offset = (offset + 7) & ~7UL;
+    sh[SEC_RELA] = (Elf64_Shdr) {
+        .sh_name = name_rela, .sh_type = SHT_RELA, .sh_flags = SHF_INFO_LINK,
+        .sh_offset = offset, .sh_size = rela.len, .sh_link = SEC_SYMTAB,
+        .sh_info = SEC_TEXT, .sh_addralign = 8,
+        .sh_entsize = sizeof(Elf64_Rela),
+    };
+    offset += rela.len;
+
+    sh[SEC_SYMTAB] = (Elf64_Shdr) {
+        .sh_name = name_symtab, .sh_type = SHT_SYMTAB, .sh_offset = offset,
+        .sh_size = symtab.len, .sh_link = SEC_STRTAB, .sh_info = first_global,
+        .sh_addralign = 8, .sh_entsize = sizeof(Elf64_Sym),
+    };
+    offset += symtab.len;
+
+    sh[SEC_STRTAB] = (Elf64_Shdr) {
+        .sh_name = name_strtab, .sh_type = SHT_STRTAB, .sh_offset = offset,
+        .sh_size = strtab.len, .sh_addralign = 1,
+    };
+    offset += strtab.len;
+
+    sh[SEC_SHSTRTAB] = (Elf64_Shdr) {
+        .sh_name = name_shstrtab, .sh_type = SHT_STRTAB, .sh_offset = offset,
+        .sh_size = shstrtab.len, .sh_addralign = 1,
+    };
+    offset += shstrtab.len;
+
+    // An empty .note.GNU-stack marks the stack as non-executable.
+    sh[SEC_NOTE] = (Elf64_Shdr) {
+        .sh_name = name_note, .sh_type = SHT_PROGBITS, .sh_offset = offset,
+        .sh_addralign = 1,
+    };
+
+    offset = (offset + 7) & ~7UL;
+    Elf64_Ehdr eh = {0};
+    memcpy(eh.e_ident, ELFMAG, SELFMAG);
+    eh.e_ident[EI_CLASS] = ELFCLASS64;
+    eh.e_ident[EI_DATA] = ELFDATA2LSB;
+    eh.e_ident[EI_VERSION] = EV_CURRENT;
+    eh.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    eh.e_type = ET_REL;
+    eh.e_machine = EM_X86_64;
+    eh.e_version = EV_CURRENT;
+    eh.e_shoff = offset;
+    eh.e_ehsize = sizeof(Elf64_Ehdr);
+    eh.e_shentsize = sizeof(Elf64_Shdr);
+    eh.e_shnum = NSECTIONS;
+    eh.e_shstrndx = SEC_SHSTRTAB;
+
+    fwrite(&eh, sizeof(eh), 1, out);
+    for (int i = 0; i < NSECTION_KINDS; ++i) {
+        if (info[i].type == SHT_NOBITS) {
+            continue;
+        }
+        for (size_t pos = ftell(out); pos < sh[info[i].index].sh_offset;
+            ++pos) {
+            fputc(0, out);
+        }
+        fwrite(sections[i].data, sections[i].len, 1, out);
+    }
+    for (size_t pos = ftell(out); pos < sh[SEC_RELA].sh_offset; ++pos) {
+        fputc(0, out);
+    }
+    fwrite(rela.data, rela.len, 1, out);
+    fwrite(symtab.data, symtab.len, 1, out);
+    fwrite(strtab.data, strtab.len, 1, out);
+    fwrite(shstrtab.data, shstrtab.len, 1, out);
+    for (size_t pos = ftell(out); pos < offset; ++pos) {
+        fputc(0, out);
+    }
+    fwrite(sh, sizeof(sh), 1, out);
+
+    free(strtab.data);
+    free(symtab.data);
+    free(rela.data);
+    free(shstrtab.data);
+}
+
+static void assemble_text(char *src) {
+    // A thread may assemble more than one file.
+    for (int i = 0; i < NSECTION_KINDS; ++i) {
+        free(sections[i].data);
+        sections[i] = (Section) { .align = i == SECTION_TEXT ? 16 : 1 };
+    }
+    current_section = SECTION_TEXT;
+    while (labels) {
+        Label *next = labels->next;
+        free(labels->name);
+        free(labels);
+        labels = next;
+    }
+    while (fixups) {
+        Fixup *next = fixups->next;
+        free(fixups);
+        fixups = next;
+    }
+    lineno = 0;
+    for (char *line = src; line && *line;) {
+        char *next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+        ++lineno;
+        assemble_line(line);
+        line = next;
+    }
+}
+
+// Assembles |src|, the output of codegen(), into an ELF relocatable object
+// file at |path|.
+void assemble(char *src, char *path) {
+    FILE *out = fopen(path, "wb");
+    if (!out) {
+        error("cannot open %s: %s", path, strerror(errno));
+    }
+    assemble_to(src, out);
+    fclose(out);
+}
+
+// Like assemble(), but writes the object file to |out|.
+void assemble_to(char *src, FILE *out) {
+    assemble_text(src);
+    write_object(out);
+}
+
+//
+// JIT
+//
+
+// Functions that JIT-compiled code may call. The binary is linked
+// statically, so there is no dynamic symbol table to look them up in.
+static struct {
+    char *name;
+    void *addr;
+} jit_symbols[] = {
+    { "abort", (void *)abort },
+    { "calloc", (void *)calloc },
+    { "exit", (void *)exit },
+    { "free", (void *)free },
+    { "malloc", (void *)malloc },
+    { "memcpy", (void *)memcpy },
+    { "memset", (void *)memset },
+    { "printf", (void *)printf },
+    { "putchar", (void *)putchar },
+    { "puts", (void *)puts },
+    { "strlen", (void *)strlen },
+};
+
+static void *find_jit_symbol(char *name) {
+    for (int i = 0; i < (int)(sizeof(jit_symbols) / sizeof(*jit_symbols));
+        ++i) {
+        if (!strcmp(jit_symbols[i].name, name)) {
+            return jit_symbols[i].addr;
+        }
+    }
+    return NULL;
+}
+
+// Assembles |src| into executable memory and calls its main().
+// Returns what main() returns.
+int jit_run(char *src) {
+    assemble_text(src);
+
+    // External functions may be anywhere in the address space, so calls
+    // go through a trampoline "jmp [rip+0]; .quad addr" after the code.
+    current_section = SECTION_TEXT;
+    for (Label *l = labels; l; l = l->next) {
+        if (l->is_defined || is_local_label(l)) {
+            continue;
+        }
+        void *addr = find_jit_symbol(l->name);
+        if (!addr) {
+            error("--run: undefined function: %s", l->name);
+        }
+        while (current_offset() % 16) {
+            emit_byte(0xcc);
+        }
+        l->section = SECTION_TEXT;
+        l->offset = current_offset();
+        l->is_defined = true;
+        emit_bytes(0x25ff, 6);
+        emit_bytes((long)addr, 8);
+    }
+
+    // The code comes first and is made executable. The data follows on
+    // pages of its own, which stay writable.
+    long page = sysconf(_SC_PAGESIZE);
+    long bases[NSECTION_KINDS];
+    long size = 0;
+    for (int i = 0; i < NSECTION_KINDS; ++i) {
+        Section *sec = &sections[i];
+        int align = i == SECTION_DATA ? page : sec->align;
+        size = (size + align - 1) / align * align;
+        bases[i] = size;
+        size += sec->len;
+    }
+    for (Fixup *f = fixups; f; f = f->next) {
+        patch_rel32(f, bases);
+    }
+
+    Label *main_label = find_label("main");
+    if (!main_label->is_defined || main_label->section != SECTION_TEXT) {
+        error("--run: main is not defined");
+    }
+
+    unsigned char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        error("--run: mmap: %s", strerror(errno));
+    }
+    for (int i = 0; i < NSECTION_KINDS; ++i) {
+        memcpy(mem + bases[i], sections[i].data, sections[i].len);
+    }
+    if (mprotect(mem, bases[SECTION_DATA], PROT_READ | PROT_EXEC)) {
+        error("--run: mprotect: %s", strerror(errno));
+    }
+
+    int (*fn)(void) = (int (*)(void))(mem + main_label->offset);
+    return fn();
+}
@@ -0,0 +1,158 @@
+#include "y3c.h"
+
+// Batch compilation of test cases.
+//
+// A manifest has one case per line: the expected exit code, the code
+// generation options, and the program, separated by tabs. Every case is
+// compiled in this one process into a single assembly file. Functions and
+// global variables are renamed to __t<N>_<name> so that the cases can be
+// linked together, and a table y3c_cases of { main, expected, source }
+// entries is emitted for the harness in test/fasttest.c to run.
+
+static void rename_calls(Node *node, Function *prog, int id);
+
+static void rename_call_list(Node *node, Function *prog, int id) {
+    for (Node *n = node; n; n = n->next) {
+        rename_calls(n, prog, id);
+    }
+}
+
+static char *namespaced(char *name, int id) {
+    int len = snprintf(NULL, 0, "__t%d_%s", id, name);
+    char *buf = malloc(len + 1);
+    snprintf(buf, len + 1, "__t%d_%s", id, name);
+    return buf;
+}
+
+// Renames calls to functions defined in |prog|. Other calls, e.g. to the
+// helpers test.sh links in, keep their names.
+static void rename_calls(Node *node, Function *prog, int id) {
+    if (!node) {
+        return;
+    }
+    if (node->kind == NODE_FUNCTION_CALL) {
+        for (Function *fn = prog; fn; fn = fn->next) {
+            if (!strcmp(fn->name, node->funcname)) {
+                node->funcname = namespaced(node->funcname, id);
+                break;
+            }
+        }
+    }
+    rename_calls(node->lhs, prog, id);
+    rename_calls(node->rhs, prog, id);
+    rename_calls(node->cond, prog, id);
+    rename_calls(node->then, prog, id);
+    rename_calls(node->els, prog, id);
+    rename_calls(node->init, prog, id);
+    rename_calls(node->inc, prog, id);
+    rename_call_list(node->body, prog, id);
+    rename_call_list(node->args, prog, id);
+}
+
+static void emit_string(FILE *out, char *s) {
+    fprintf(out, "  .string \"");
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', out);
+        }
+        fputc(*s, out);
+    }
+    fprintf(out, "\"\n");
+}
+
+// Splits off the next tab-separated field of |*line|.
+static char *next_field(char **line, int lineno) {
+    char *field = *line;
+    char *tab = strchr(field, '\t');
+    if (!tab) {
+        error("manifest line %d: expected 3 tab-separated fields", lineno);
+    }
+    *tab = '\0';
+    *line = tab + 1;
+    return field;
+}
+
+void compile_batch(char *manifest_path, FILE *out) {
+    FILE *fp = fopen(manifest_path, "r");
+    if (!fp) {
+        error("cannot open %s", manifest_path);
+    }
+
+    int ncases = 0;
+    int cap = 0;
+    int *expected = NULL;
+    char **sources = NULL;
+
+    char *line = NULL;
+    size_t len = 0;
+    int lineno = 0;
+    while (getline(&line, &len, fp) != -1) {
+        ++lineno;
+        line[strcspn(line, "\n")] = '\0';
+        if (!*line) {
+            continue;
+        }
+
+        char *rest = line;
+        int exp = atoi(next_field(&rest, lineno));
+        char *flags = next_field(&rest, lineno);
+        // Tokens point into the source, so it has to outlive this loop.
+        char *source = strdup(rest);
+
+        reset_codegen_options();
+        for (char *opt = strtok(flags, " "); opt; opt = strtok(NULL, " ")) {
+            if (!parse_codegen_option(opt)) {
+                error("manifest line %d: unknown option: %s", lineno, opt);
+            }
+        }
+
+        Function *prog = parse(tokenize(source), 1);
+        bool has_main = false;
+        for (Function *fn = prog; fn; fn = fn->next) {
+            layout_frame(fn);
+            rename_call_list(fn->node, prog, ncases);
+        }
+        for (Function *fn = prog; fn; fn = fn->next) {
+            has_main |= !fn->var && !strcmp(fn->name, "main");
+            fn->name = namespaced(fn->name, ncases);
+            if (fn->var) {
+                fn->var->name = fn->name;
+            }
+        }
+        if (!has_main) {
+            error("manifest line %d: main is not defined", lineno);
+        }
+        codegen(prog, out, 1);
+
+        if (ncases == cap) {
+            cap = cap ? cap * 2 : 256;
+            expected = realloc(expected, cap * sizeof(*expected));
+            sources = realloc(sources, cap * sizeof(*sources));
+        }
+        expected[ncases] = exp;
+        sources[ncases] = source;
+        ++ncases;
+    }
+    free(line);
+    fclose(fp);
+    reset_codegen_options();
+
+    // struct { int (*main)(void); long expected; char *source; } y3c_cases[]
+    // terminated by an entry with a null main.
+    fprintf(out, ".data\n");
+    fprintf(out, ".balign 8\n");
+    fprintf(out, ".global y3c_cases\n");
+    fprintf(out, "y3c_cases:\n");
+    for (int i = 0; i < ncases; ++i) {
+        fprintf(out, "  .quad __t%d_main\n", i);
+        fprintf(out, "  .quad %d\n", expected[i]);
+        fprintf(out, "  .quad .L.case.%d\n", i);
+    }
+    fprintf(out, "  .quad 0, 0, 0\n");
+    fprintf(out, ".section .rodata\n");
+    for (int i = 0; i < ncases; ++i) {
+        fprintf(out, ".L.case.%d:\n", i);
+        emit_string(out, sources[i]);
+    }
+    fprintf(out, ".section .note.GNU-stack,\"\",@progbits\n");
+}
@@ -0,0 +1,248 @@
+#include "y3c.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Compilation cache.
+//
+// The assembly generated for a function is stored in |cache_dir| under a
+// hash of everything it depends on: the function's tokens, the return types
+// of the functions it calls, the code generation options and the compiler
+// binary itself. A function whose hash is found there is neither parsed
+// nor generated again.
+//
+// Entries are written to a temporary file and renamed into place, so
+// readers never see a partial entry. A hit updates the entry's
+// modification time, and when the cache grows beyond |cache_max_size|, the
+// entries used least recently are deleted.
+
+char *cache_dir;
+long cache_max_size = 64 * 1024 * 1024;
+
+static atomic_int hits;
+static atomic_int misses;
+static atomic_int evictions;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t size_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned __int128 compiler_hash;
+static long cache_size;
+
+// 128-bit FNV-1a.
+#define FNV_PRIME (((unsigned __int128)1 << 88) + 0x13b)
+#define FNV_OFFSET \
+    (((unsigned __int128)0x6c62272e07bb0142 << 64) + 0x62b821756295c58d)
+
+static unsigned __int128 fnv(unsigned __int128 h, void *data, size_t len) {
+    unsigned char *p = data;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static char *entry_path(char *name) {
+    int len = snprintf(NULL, 0, "%s/%s", cache_dir, name);
+    char *buf = malloc(len + 1);
+    snprintf(buf, len + 1, "%s/%s", cache_dir, name);
+    return buf;
+}
+
+// Entries are named by 32 hex digits. Anything else, like a temporary file
+// being written, is not an entry.
+static bool is_entry(char *name) {
+    return strlen(name) == 32 && strspn(name, "0123456789abcdef") == 32;
+}
+
+// Returns the total size of the entries.
+static long scan_cache(void) {
+    DIR *dir = opendir(cache_dir);
+    if (!dir) {
+        return 0;
+    }
+    long total = 0;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        struct stat st;
+        char *path = entry_path(de->d_name);
+        if (is_entry(de->d_name) && !stat(path, &st)) {
+            total += st.st_size;
+        }
+        free(path);
+    }
+    closedir(dir);
+    return total;
+}
+
+static void init_cache(void) {
+    mkdir(cache_dir, 0777);
+    cache_size = scan_cache();
+
+    // Any change to the compiler invalidates the cache.
+    FILE *fp = fopen("/proc/self/exe", "r");
+    if (!fp) {
+        error("cache: cannot read the compiler binary");
+    }
+    compiler_hash = FNV_OFFSET;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        compiler_hash = fnv(compiler_hash, buf, n);
+    }
+    fclose(fp);
+}
+
+// Returns the cache key for a function whose dependencies are serialized
+// in |data|, or NULL if the cache is not used.
+char *cache_key(void *data, size_t len) {
+    // Profiles are not part of the key, so their code is not cached.
+    if (!cache_dir || opt_profile_generate || opt_profile_use) {
+        return NULL;
+    }
+    pthread_once(&init_once, init_cache);
+
+    // Every option that affects code generation belongs here.
+    int opts[] = {
+        opt_avx2, opt_unroll_factor, opt_stack_coloring, opt_line_tables,
+    };
+    unsigned __int128 h = fnv(compiler_hash, opts, sizeof(opts));
+    h = fnv(h, data, len);
+
+    char *key = malloc(33);
+    snprintf(key, 33, "%016lx%016lx",
+        (unsigned long)(h >> 64), (unsigned long)h);
+    return key;
+}
+
+// Returns the assembly stored under |key|, or NULL.
+char *cache_lookup(char *key) {
+    char *path = entry_path(key);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        free(path);
+        ++misses;
+        return NULL;
+    }
+    char *buf;
+    size_t buflen;
+    FILE *out = open_memstream(&buf, &buflen);
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        fwrite(chunk, 1, n, out);
+    }
+    fclose(fp);
+    fclose(out);
+
+    // Mark the entry as recently used.
+    utimensat(AT_FDCWD, path, NULL, 0);
+    free(path);
+    ++hits;
+    return buf;
+}
+
+typedef struct Entry Entry;
+struct Entry {
+    char *path;
+    long size;
+    struct timespec mtime;
+};
+
+static int compare_entries(const void *a, const void *b) {
+    const Entry *x = a;
+    const Entry *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec) {
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    }
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec) {
+        return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+// Deletes the least recently used entries until the cache is at most 3/4
+// of its maximum size, which leaves room before the next eviction. Other
+// processes may be evicting at the same time, so entries may disappear
+// under us.
+static void evict(void) {
+    DIR *dir = opendir(cache_dir);
+    if (!dir) {
+        return;
+    }
+    Entry *entries = NULL;
+    int n = 0;
+    int cap = 0;
+    long total = 0;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        struct stat st;
+        char *path = entry_path(de->d_name);
+        if (!is_entry(de->d_name) || stat(path, &st)) {
+            free(path);
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            entries = realloc(entries, cap * sizeof(Entry));
+        }
+        entries[n++] = (Entry) { path, st.st_size, st.st_mtim };
+        total += st.st_size;
+    }
+    closedir(dir);
+
+    qsort(entries, n, sizeof(Entry), compare_entries);
+    for (int i = 0; i < n; ++i) {
+        if (total > cache_max_size / 4 * 3 && !unlink(entries[i].path)) {
+            total -= entries[i].size;
+            ++evictions;
+        }
+        free(entries[i].path);
+    }
+    free(entries);
+    cache_size = total;
+}
+
+// Stores |len| bytes of assembly at |text| under |key|.
+void cache_store(char *key, char *text, size_t len) {
+    int tmplen = snprintf(NULL, 0, "%s/tmp.%d.%lx",
+        cache_dir, getpid(), (unsigned long)pthread_self());
+    char *tmp = malloc(tmplen + 1);
+    snprintf(tmp, tmplen + 1, "%s/tmp.%d.%lx",
+        cache_dir, getpid(), (unsigned long)pthread_self());
+
+    // The cache is only an optimization, so failing to write is not an
+    // error.
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        free(tmp);
+        return;
+    }
+    bool ok = fwrite(text, 1, len, fp) == len;
+    ok &= !fclose(fp);
+    char *path = entry_path(key);
+    if (!ok || rename(tmp, path)) {
+        unlink(tmp);
+        free(tmp);
+        free(path);
+        return;
+    }
+    free(tmp);
+    free(path);
+
+    pthread_mutex_lock(&size_lock);
+    cache_size += len;
+    if (cache_size > cache_max_size) {
+        evict();
+    }
+    pthread_mutex_unlock(&size_lock);
+}
+
+void print_cache_stats(FILE *out) {
+    fprintf(out, "cache: %d hits, %d misses, %d evictions\n",
+        hits, misses, evictions);
+}
@@ -1,9 +1,18 @@
 #include "y3c.h"
 
-static int top;
-static int labelseq = 1;
+#include <pthread.h>
+
+static _Thread_local FILE *output_file;
+static _Thread_local int top;
+static _Thread_local int labelseq = 1;
 static char *argreg[] = { "rdi", "rsi", "rdx", "rcx", "r8", "r9" };
-static char *funcname;
+static _Thread_local char *funcname;
+// Instructions emitted by this thread, for --stats.
+static _Thread_local long ninstructions;
+// Profile counts of the function being generated, or NULL.
+static _Thread_local long *counts;
+// Code moved out of line, which follows the function's epilogue.
+static _Thread_local FILE *cold_file;
 
 static char *reg(int idx) {
     static char *r[] = { "r10", "r11", "r12", "r13", "r14", "r15" };
@@ -12,12 +21,177 @@ static char *reg(int idx) {
     return r[idx];
 }
 
+// Returns the low |size| bytes of reg(|idx|).
+static char *sized_reg(int idx, int size) {
+    static char *r8[] = { "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" };
+    static char *r16[] = { "r10w", "r11w", "r12w", "r13w", "r14w", "r15w" };
+    static char *r32[] = { "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" };
+    if (size == 1)
+        return r8[idx];
+    if (size == 2)
+        return r16[idx];
+    if (size == 4)
+        return r32[idx];
+    return reg(idx);
+}
+
+// Returns the low |size| bytes of argreg[|idx|].
+static char *sized_argreg(int idx, int size) {
+    static char *r8[] = { "dil", "sil", "dl", "cl", "r8b", "r9b" };
+    static char *r16[] = { "di", "si", "dx", "cx", "r8w", "r9w" };
+    static char *r32[] = { "edi", "esi", "edx", "ecx", "r8d", "r9d" };
+    if (size == 1)
+        return r8[idx];
+    if (size == 2)
+        return r16[idx];
+    if (size == 4)
+        return r32[idx];
+    return argreg[idx];
+}
+
+// Writes a line of assembly to the output.
+void emit(char *fmt, ...) {
+    // Instructions are indented, unlike labels and most directives.
+    if (fmt[0] == ' ' && fmt[2] != '.') {
+        ++ninstructions;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(output_file, fmt, ap);
+    va_end(ap);
+}
+
 static void generate_asm(Node *node);
+static void generate_statement(Node *node);
+static void generate_branch(Node *node, bool when, char *label, int seq);
+
+// Returns k if |n| == 2^k, or -1 otherwise.
+static int log2_exact(uint64_t n) {
+    if (n == 0 || (n & (n - 1))) {
+        return -1;
+    }
+    int k = 0;
+    while (n >>= 1) {
+        ++k;
+    }
+    return k;
+}
+
+// Computes the magic multiplier and post-shift for signed 64-bit division by
+// |d|, where d >= 3 is not a power of two. See Hacker's Delight, 10-4.
+static void signed_magic(uint64_t d, int64_t *magic, int *shift) {
+    const uint64_t two63 = 1ULL << 63;
+    uint64_t anc = two63 - 1 - two63 % d;
+    uint64_t q1 = two63 / anc;
+    uint64_t r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / d;
+    uint64_t r2 = two63 - q2 * d;
+    uint64_t delta;
+    int p = 63;
+    do {
+        ++p;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            ++q1;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= d) {
+            ++q2;
+            r2 -= d;
+        }
+        delta = d - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    *magic = (int64_t)(q2 + 1);
+    *shift = p - 64;
+}
+
+// Multiplies |r| by the constant |c| in place.
+static void generate_mul_by_const(char *r, int c) {
+    int k = c > 0 ? log2_exact(c) : -1;
+    if (c == 0) {
+        emit("  mov %s, 0\n", r);
+    }
+    else if (k == 0) {
+        return;
+    }
+    else if (k > 0) {
+        emit("  shl %s, %d\n", r, k);
+    }
+    else if (c == 3 || c == 5 || c == 9) {
+        emit("  lea %s, [%s+%s*%d]\n", r, r, r, c - 1);
+    }
+    else {
+        emit("  imul %s, %s, %d\n", r, r, c);
+    }
+}
+
+// Divides |r| by the constant |d| in place, or takes the remainder if
+// |is_mod|, without using idiv. The quotient truncates toward zero as C
+// requires. RAX and RDX are clobbered just like the idiv sequence does.
+static void generate_div_by_const(char *r, int d, bool is_mod) {
+    uint64_t ad = d < 0 ? -(int64_t)d : d;
+    int k = log2_exact(ad);
+
+    // Compute the quotient n / |d| into RAX.
+    if (k == 0) {
+        emit("  mov rax, %s\n", r);
+    }
+    else if (k > 0) {
+        // Bias negative dividends by 2^k-1 so that the arithmetic shift
+        // rounds toward zero rather than toward negative infinity.
+        emit("  mov rax, %s\n", r);
+        emit("  sar rax, 63\n");
+        emit("  shr rax, %d\n", 64 - k);
+        emit("  add rax, %s\n", r);
+        emit("  sar rax, %d\n", k);
+    }
+    else {
+        int64_t magic;
+        int shift;
+        signed_magic(ad, &magic, &shift);
+        // RDX <- high 64 bits of n * magic.
+        emit("  mov rax, %lld\n", (long long)magic);
+        emit("  imul %s\n", r);
+        if (magic < 0) {
+            emit("  add rdx, %s\n", r);
+        }
+        if (shift > 0) {
+            emit("  sar rdx, %d\n", shift);
+        }
+        // Add one to negative quotients.
+        emit("  mov rax, rdx\n");
+        emit("  shr rax, 63\n");
+        emit("  add rax, rdx\n");
+    }
+
+    if (is_mod) {
+        // n % d == n - (n / |d|) * |d|, whatever the sign of d.
+        if (k >= 0) {
+            emit("  shl rax, %d\n", k);
+        }
+        else {
+            emit("  imul rax, rax, %d\n", (int)ad);
+        }
+        emit("  sub %s, rax\n", r);
+        return;
+    }
+    if (d < 0) {
+        emit("  neg rax\n");
+    }
+    emit("  mov %s, rax\n", r);
+}
 
 // Pushes the given node's address to the stack.
 static void generate_address(Node *node) {
-    if (node->kind == NODE_VAR) {
-        printf("  lea %s, [rbp-%d]\n", reg(top++), node->var->offset);
+    if (node->kind == NODE_VAR && node->var->is_global) {
+        emit("  lea %s, [rip+.L.global.%s]\n", reg(top++), node->var->name);
+        return;
+    }
+    else if (node->kind == NODE_VAR) {
+        emit("  lea %s, [rbp-%d]\n", reg(top++), node->var->offset);
         return;
     }
     else if (node->kind == NODE_DEREFERENCE) {
@@ -38,17 +212,193 @@ static void load(Type *ty) {
         // the array in C" occurs.
         return;
     }
-    printf("  mov %s, [%s]\n", reg(top - 1), reg(top - 1));
+
+    // Integers narrower than a register are sign-extended on load, so that
+    // every value in a register is a valid 64-bit integer.
+    char *r = reg(top - 1);
+    if (ty->size == 1) {
+        emit("  movsx %s, byte ptr [%s]\n", r, r);
+    }
+    else if (ty->size == 2) {
+        emit("  movsx %s, word ptr [%s]\n", r, r);
+    }
+    else if (ty->size == 4) {
+        emit("  movsxd %s, dword ptr [%s]\n", r, r);
+    }
+    else {
+        emit("  mov %s, [%s]\n", r, r);
+    }
 }
 
-static void store(void) {
-    printf("  mov [%s], %s\n", reg(top - 1), reg(top - 2));
+static void store(Type *ty) {
+    emit("  mov [%s], %s\n", reg(top - 1), sized_reg(top - 2, ty->size));
     --top;
 }
 
+// Compound assignments.
+//
+// x op= y, ++x and x++ evaluate the address of x only once. Where nothing
+// uses their value, as in expression statements and loop increments, +=,
+// -=, ++ and -- update x in memory with a single read-modify-write
+// instruction instead of loading, computing and storing it back.
+
+static bool is_compound_assign(NodeKind kind) {
+    return kind == NODE_ADD_ASSIGN || kind == NODE_SUB_ASSIGN
+        || kind == NODE_MUL_ASSIGN || kind == NODE_DIV_ASSIGN
+        || kind == NODE_POST_INC || kind == NODE_POST_DEC;
+}
+
+static char *ptr_size(int size) {
+    if (size == 1)
+        return "byte";
+    if (size == 2)
+        return "word";
+    if (size == 4)
+        return "dword";
+    return "qword";
+}
+
+// Returns true if |node| is a constant that fits the immediate operand of
+// a |size|-byte instruction.
+static bool is_imm(Node *node, int size) {
+    if (node->kind != NODE_NUM) {
+        return false;
+    }
+    if (size == 1) {
+        return -128 <= node->val && node->val <= 127;
+    }
+    if (size == 2) {
+        return -32768 <= node->val && node->val <= 32767;
+    }
+    return true;
+}
+
+// Sign-extends the low |size| bytes of reg(|idx|) to all of it.
+static void sign_extend(int idx, int size) {
+    if (size == 1 || size == 2) {
+        emit("  movsx %s, %s\n", reg(idx), sized_reg(idx, size));
+    }
+    else if (size == 4) {
+        emit("  movsxd %s, %s\n", reg(idx), sized_reg(idx, size));
+    }
+}
+
+// Emits x += y or x -= y, whose value is unused, as one instruction
+// updating x in memory.
+static void generate_update_in_place(Node *node, char *op) {
+    int size = node->ty->size;
+    int origin = top;
+    bool imm = is_imm(node->rhs, size);
+    if (!imm) {
+        generate_asm(node->rhs);
+    }
+
+    char dst[256];
+    Var *var = node->lhs->kind == NODE_VAR ? node->lhs->var : NULL;
+    if (var && var->is_global) {
+        snprintf(dst, sizeof(dst), "[rip+.L.global.%s]", var->name);
+    }
+    else if (var) {
+        snprintf(dst, sizeof(dst), "[rbp-%d]", var->offset);
+    }
+    else {
+        generate_address(node->lhs);
+        snprintf(dst, sizeof(dst), "[%s]", reg(top - 1));
+    }
+
+    if (imm) {
+        emit("  %s %s ptr %s, %d\n", op, ptr_size(size), dst, node->rhs->val);
+    }
+    else {
+        emit("  %s %s, %s\n", op, dst, sized_reg(origin, size));
+    }
+    top = origin;
+}
+
+// Pushes the value of the compound assignment |node| if |is_used|.
+static void generate_compound_assign(Node *node, bool is_used) {
+    if (node->ty->kind == TY_ARRAY) {
+        error_tok(node->tok, "not an lvalue.");
+    }
+    NodeKind kind = node->kind;
+    bool is_add = kind == NODE_ADD_ASSIGN || kind == NODE_POST_INC;
+    bool is_sub = kind == NODE_SUB_ASSIGN || kind == NODE_POST_DEC;
+    if (!is_used && (is_add || is_sub)) {
+        generate_update_in_place(node, is_add ? "add" : "sub");
+        return;
+    }
+
+    // Dividing by a constant 0 takes the idiv path, which traps like the
+    // program asked for.
+    int origin = top;
+    int size = node->ty->size;
+    bool imm = node->rhs->kind == NODE_NUM
+        && (kind != NODE_DIV_ASSIGN || node->rhs->val != 0);
+    if (!imm) {
+        generate_asm(node->rhs);
+    }
+    char *r_rhs = reg(origin);
+    generate_address(node->lhs);
+    char *addr = reg(top - 1);
+    emit("  mov %s, %s\n", reg(top), addr);
+    ++top;
+    load(node->ty);
+
+    // x++ and x-- compute the new value in a copy and yield the old one.
+    int old = top - 1;
+    bool is_post = kind == NODE_POST_INC || kind == NODE_POST_DEC;
+    if (is_post) {
+        emit("  mov %s, %s\n", reg(top), reg(old));
+        ++top;
+    }
+    int idx = top - 1;
+    char *r = reg(idx);
+    int val = node->rhs->val;
+
+    if (is_add || is_sub) {
+        if (imm) {
+            emit("  %s %s, %d\n", is_add ? "add" : "sub", r, val);
+        }
+        else {
+            emit("  %s %s, %s\n", is_add ? "add" : "sub", r, r_rhs);
+        }
+    }
+    else if (kind == NODE_MUL_ASSIGN) {
+        if (imm) {
+            generate_mul_by_const(r, val);
+        }
+        else {
+            emit("  imul %s, %s\n", r, r_rhs);
+        }
+    }
+    else if (imm) {
+        generate_div_by_const(r, val, false);
+    }
+    else {
+        emit("  mov rax, %s\n", r);
+        emit("  cqo\n");
+        emit("  idiv %s\n", r_rhs);
+        emit("  mov %s, rax\n", r);
+    }
+    emit("  mov [%s], %s\n", addr, sized_reg(idx, size));
+
+    top = origin;
+    if (!is_used) {
+        return;
+    }
+    // The value is that of x after the assignment, wrapped to its type.
+    if (is_post) {
+        idx = old;
+    }
+    else {
+        sign_extend(idx, size);
+    }
+    emit("  mov %s, %s\n", reg(top++), reg(idx));
+}
+
 static void generate_asm(Node *node) {
     if (node->kind == NODE_NUM) {
-        printf("  mov %s, %d\n", reg(top++), node->val);
+        emit("  mov %s, %d\n", reg(top++), node->val);
         return;
     }
     else if (node->kind == NODE_VAR) {
@@ -71,45 +421,96 @@ static void generate_asm(Node *node) {
         }
         generate_asm(node->rhs);
         generate_address(node->lhs);
-        store();
+        store(node->ty);
+        return;
+    }
+    else if (is_compound_assign(node->kind)) {
+        generate_compound_assign(node, true);
         return;
     }
     else if (node->kind == NODE_FUNCTION_CALL) {
 
         int top_origin = top;
         top = 0;
-        printf("  push r10\n");
-        printf("  push r11\n");
-        printf("  push r12\n");
-        printf("  push r13\n");
-        printf("  push r14\n");
-        printf("  push r15\n");
+        emit("  push r10\n");
+        emit("  push r11\n");
+        emit("  push r12\n");
+        emit("  push r13\n");
+        emit("  push r14\n");
+        emit("  push r15\n");
 
         int nargs = 0;
         for (Node *arg = node->args; arg; arg = arg->next) {
             generate_asm(arg);
-            printf("  push %s\n", reg(--top));
-            printf("  sub rsp, 8\n");
+            emit("  push %s\n", reg(--top));
+            emit("  sub rsp, 8\n");
             ++nargs;
         }
 
         for (int i = nargs - 1; i >= 0; --i) {
-            printf("  add rsp, 8\n");
-            printf("  pop %s\n", argreg[i]);
+            emit("  add rsp, 8\n");
+            emit("  pop %s\n", argreg[i]);
         }
 
-        printf("  mov rax, 0\n");
-        printf("  call %s\n", node->funcname);
+        emit("  mov rax, 0\n");
+        emit("  call %s\n", node->funcname);
 
         top = top_origin;
-        printf("  pop r15\n");
-        printf("  pop r14\n");
-        printf("  pop r13\n");
-        printf("  pop r12\n");
-        printf("  pop r11\n");
-        printf("  pop r10\n");
-        printf("  mov %s, rax\n", reg(top++));
+        emit("  pop r15\n");
+        emit("  pop r14\n");
+        emit("  pop r13\n");
+        emit("  pop r12\n");
+        emit("  pop r11\n");
+        emit("  pop r10\n");
 
+        // Only the low bytes of RAX are defined for narrow return types.
+        int size = node->ty->size;
+        if (size == 1) {
+            emit("  movsx %s, al\n", reg(top++));
+        }
+        else if (size == 2) {
+            emit("  movsx %s, ax\n", reg(top++));
+        }
+        else if (size == 4) {
+            emit("  movsxd %s, eax\n", reg(top++));
+        }
+        else {
+            emit("  mov %s, rax\n", reg(top++));
+        }
+
+        return;
+    }
+    else if (node->kind == NODE_LOGAND || node->kind == NODE_LOGOR) {
+        int seq = labelseq++;
+        generate_branch(node, false, "false", seq);
+        emit("  mov %s, 1\n", reg(top));
+        emit("  jmp .L.done.%s.%d\n", funcname, seq);
+        emit(".L.false.%s.%d:\n", funcname, seq);
+        emit("  mov %s, 0\n", reg(top));
+        emit(".L.done.%s.%d:\n", funcname, seq);
+        ++top;
+        return;
+    }
+    else if (node->kind == NODE_NOT) {
+        generate_asm(node->lhs);
+        emit("  cmp %s, 0\n", reg(top - 1));
+        emit("  sete al\n");
+        emit("  movzx %s, al\n", reg(top - 1));
+        return;
+    }
+    else if ((node->kind == NODE_MUL || node->kind == NODE_DIV
+        || node->kind == NODE_MOD) && node->rhs->kind == NODE_NUM
+        && (node->kind == NODE_MUL || node->rhs->val != 0)) {
+        // Strength-reduce arithmetic with a constant right operand, e.g. the
+        // element size scaling in pointer arithmetic.
+        generate_asm(node->lhs);
+        if (node->kind == NODE_MUL) {
+            generate_mul_by_const(reg(top - 1), node->rhs->val);
+        }
+        else {
+            generate_div_by_const(
+                reg(top - 1), node->rhs->val, node->kind == NODE_MOD);
+        }
         return;
     }
 
@@ -123,61 +524,79 @@ static void generate_asm(Node *node) {
 
     switch (node->kind) {
     case NODE_ADD:
-        printf("  add %s, %s\n", r_lhs, r_rhs);
+        emit("  add %s, %s\n", r_lhs, r_rhs);
         break;
     case NODE_SUB:
-        printf("  sub %s, %s\n", r_lhs, r_rhs);
+        emit("  sub %s, %s\n", r_lhs, r_rhs);
         break;
     case NODE_MUL:
-        printf("  imul %s, %s\n", r_lhs, r_rhs);
+        emit("  imul %s, %s\n", r_lhs, r_rhs);
         break;
     case NODE_DIV:
-        printf("  mov rax, %s\n", r_lhs);
+        emit("  mov rax, %s\n", r_lhs);
         // RDX:RAX <- sign-extend of RAX.
-        printf("  cqo\n");
+        emit("  cqo\n");
         // Signed divide RDX:RAX by rdi with result stored in RAX(quotient),
         // RDX(remainder)
-        printf("  idiv %s\n", r_rhs);
-        printf("  mov %s, rax\n", r_lhs);
+        emit("  idiv %s\n", r_rhs);
+        emit("  mov %s, rax\n", r_lhs);
+        break;
+    case NODE_MOD:
+        emit("  mov rax, %s\n", r_lhs);
+        emit("  cqo\n");
+        emit("  idiv %s\n", r_rhs);
+        emit("  mov %s, rdx\n", r_lhs);
         break;
     case NODE_EQ:
-        printf("  cmp %s, %s\n", r_lhs, r_rhs);
-        printf("  sete al\n");
-        printf("  movzx %s, al\n", r_lhs);
+        emit("  cmp %s, %s\n", r_lhs, r_rhs);
+        emit("  sete al\n");
+        emit("  movzx %s, al\n", r_lhs);
         break;
     case NODE_NE:
-        printf("  cmp %s, %s\n", r_lhs, r_rhs);
-        printf("  setne al\n");
-        printf("  movzx %s, al\n", r_lhs);
+        emit("  cmp %s, %s\n", r_lhs, r_rhs);
+        emit("  setne al\n");
+        emit("  movzx %s, al\n", r_lhs);
         break;
     case NODE_LT:
-        printf("  cmp %s, %s\n", r_lhs, r_rhs);
-        printf("  setl al\n");
-        printf("  movzx %s, al\n", r_lhs);
+        emit("  cmp %s, %s\n", r_lhs, r_rhs);
+        emit("  setl al\n");
+        emit("  movzx %s, al\n", r_lhs);
         break;
     case NODE_LE:
-        printf("  cmp %s, %s\n", r_lhs, r_rhs);
-        printf("  setle al\n");
-        printf("  movzx %s, al\n", r_lhs);
+        emit("  cmp %s, %s\n", r_lhs, r_rhs);
+        emit("  setle al\n");
+        emit("  movzx %s, al\n", r_lhs);
         break;
     case NODE_GT:
-        printf("  cmp %s, %s\n", r_lhs, r_rhs);
-        printf("  setg al\n");
-        printf("  movzx %s, al\n", r_lhs);
+        emit("  cmp %s, %s\n", r_lhs, r_rhs);
+        emit("  setg al\n");
+        emit("  movzx %s, al\n", r_lhs);
         break;
     case NODE_GE:
-        printf("  cmp %s, %s\n", r_lhs, r_rhs);
-        printf("  setge al\n");
-        printf("  movzx %s, al\n", r_lhs);
+        emit("  cmp %s, %s\n", r_lhs, r_rhs);
+        emit("  setge al\n");
+        emit("  movzx %s, al\n", r_lhs);
         break;
+    case NODE_LOGAND:
+    case NODE_LOGOR:
+    case NODE_NOT:
     case NODE_ADDRESS:
     case NODE_DEREFERENCE:
     case NODE_EXPR_STATEMENT:
     case NODE_RETURN:
     case NODE_ASSIGN:
+    case NODE_ADD_ASSIGN:
+    case NODE_SUB_ASSIGN:
+    case NODE_MUL_ASSIGN:
+    case NODE_DIV_ASSIGN:
+    case NODE_POST_INC:
+    case NODE_POST_DEC:
     case NODE_IF:
     case NODE_FOR:
     case NODE_BLOCK:
+    case NODE_SWITCH:
+    case NODE_CASE:
+    case NODE_BREAK:
     case NODE_VAR:
     case NODE_NUM:
     case NODE_FUNCTION_CALL:
@@ -187,106 +606,942 @@ static void generate_asm(Node *node) {
     }
 }
 
+// Conditions.
+//
+// The operands of && and || are evaluated only as far as they decide the
+// result, so they become branches. The conditions of if statements and
+// loops jump straight to their targets, comparisons included, and only
+// conditions whose value is used are materialized as 0 or 1.
+
+// Returns the condition code under which comparison |kind| is |when|, or
+// NULL if |kind| is no comparison.
+static char *jump_condition(NodeKind kind, bool when) {
+    static struct {
+        NodeKind kind;
+        char *holds;
+        char *fails;
+    } codes[] = {
+        { NODE_EQ, "e", "ne" }, { NODE_NE, "ne", "e" },
+        { NODE_LT, "l", "ge" }, { NODE_LE, "le", "g" },
+        { NODE_GT, "g", "le" }, { NODE_GE, "ge", "l" },
+    };
+    for (int i = 0; i < (int)(sizeof(codes) / sizeof(*codes)); ++i) {
+        if (codes[i].kind == kind) {
+            return when ? codes[i].holds : codes[i].fails;
+        }
+    }
+    return NULL;
+}
+
+// Emits a jump to .L.|label|.|seq| taken if |node| is |when|, and falls
+// through otherwise.
+static void generate_branch(Node *node, bool when, char *label, int seq) {
+    if (node->kind == NODE_NOT) {
+        generate_branch(node->lhs, !when, label, seq);
+        return;
+    }
+    if (node->kind == NODE_LOGAND || node->kind == NODE_LOGOR) {
+        // a && b is true only if both are, and a || b false only if both
+        // are. Otherwise the first operand that decides it jumps.
+        bool both = node->kind == NODE_LOGAND;
+        if (when == both) {
+            int skip = labelseq++;
+            generate_branch(node->lhs, !when, "skip", skip);
+            generate_branch(node->rhs, when, label, seq);
+            emit(".L.skip.%s.%d:\n", funcname, skip);
+        }
+        else {
+            generate_branch(node->lhs, when, label, seq);
+            generate_branch(node->rhs, when, label, seq);
+        }
+        return;
+    }
+    char *cc = jump_condition(node->kind, when);
+    if (cc && node->rhs->kind == NODE_NUM) {
+        generate_asm(node->lhs);
+        emit("  cmp %s, %d\n", reg(--top), node->rhs->val);
+    }
+    else if (cc) {
+        generate_asm(node->lhs);
+        generate_asm(node->rhs);
+        top -= 2;
+        emit("  cmp %s, %s\n", reg(top), reg(top + 1));
+    }
+    else {
+        generate_asm(node);
+        emit("  cmp %s, 0\n", reg(--top));
+        cc = when ? "ne" : "e";
+    }
+    emit("  j%s .L.%s.%s.%d\n", cc, label, funcname, seq);
+}
+
+// Loop unrolling.
+//
+// Counted loops "for (i = c; i < n; i = i + s)" whose body leaves i alone
+// are unrolled. With constant bounds and a small trip count the loop is
+// replaced by straight-line copies of the body. Otherwise, innermost loops
+// get a main loop running |opt_unroll_factor| iterations per test in front
+// of the original loop, which then handles the remainder.
+
+// Upper bound on the AST nodes emitted for an unrolled loop body.
+#define UNROLL_BUDGET 256
+// Upper bound on the trip count of fully unrolled loops.
+#define FULL_UNROLL_MAX_TRIPS 16
+
+// Returns the number of AST nodes under |node|.
+static int count_nodes(Node *node) {
+    if (!node) {
+        return 0;
+    }
+    int n = 1 + count_nodes(node->lhs) + count_nodes(node->rhs)
+        + count_nodes(node->cond) + count_nodes(node->then)
+        + count_nodes(node->els) + count_nodes(node->init)
+        + count_nodes(node->inc);
+    for (Node *n2 = node->body; n2; n2 = n2->next) {
+        n += count_nodes(n2);
+    }
+    for (Node *n2 = node->args; n2; n2 = n2->next) {
+        n += count_nodes(n2);
+    }
+    return n;
+}
+
+// Returns true if |node| contains a node of |kind|.
+static bool contains_kind(Node *node, NodeKind kind) {
+    if (!node) {
+        return false;
+    }
+    if (node->kind == kind) {
+        return true;
+    }
+    if (contains_kind(node->lhs, kind) || contains_kind(node->rhs, kind)
+        || contains_kind(node->cond, kind) || contains_kind(node->then, kind)
+        || contains_kind(node->els, kind) || contains_kind(node->init, kind)
+        || contains_kind(node->inc, kind)) {
+        return true;
+    }
+    for (Node *n = node->body; n; n = n->next) {
+        if (contains_kind(n, kind)) {
+            return true;
+        }
+    }
+    for (Node *n = node->args; n; n = n->next) {
+        if (contains_kind(n, kind)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns true if the loop analyses can see every write to |var|, which
+// holds for locals whose address is never taken.
+static bool is_tracked(Var *var) {
+    return !var->is_global && !var->is_address_taken;
+}
+
+// Returns true if |node| may write to |var|. Only tracked variables are
+// asked about, which a direct assignment is the only way to write.
+static bool assigns_var(Node *node, Var *var) {
+    if (!node) {
+        return false;
+    }
+    if ((node->kind == NODE_ASSIGN || is_compound_assign(node->kind))
+        && node->lhs->kind == NODE_VAR
+        && node->lhs->var == var) {
+        return true;
+    }
+    if (assigns_var(node->lhs, var) || assigns_var(node->rhs, var)
+        || assigns_var(node->cond, var) || assigns_var(node->then, var)
+        || assigns_var(node->els, var) || assigns_var(node->init, var)
+        || assigns_var(node->inc, var)) {
+        return true;
+    }
+    for (Node *n = node->body; n; n = n->next) {
+        if (assigns_var(n, var)) {
+            return true;
+        }
+    }
+    for (Node *n = node->args; n; n = n->next) {
+        if (assigns_var(n, var)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns s if |node| adds the constant s to |var|, as "i = i + s",
+// "i += s", "++i" and "i++" do, or 0 otherwise.
+int var_increment(Node *node, Var *var) {
+    if (node->lhs->kind != NODE_VAR || node->lhs->var != var) {
+        return 0;
+    }
+    if (node->kind == NODE_ADD_ASSIGN || node->kind == NODE_POST_INC) {
+        return node->rhs->kind == NODE_NUM ? node->rhs->val : 0;
+    }
+    Node *sum = node->rhs;
+    if (node->kind != NODE_ASSIGN || sum->kind != NODE_ADD
+        || sum->lhs->kind != NODE_VAR || sum->lhs->var != var
+        || sum->rhs->kind != NODE_NUM) {
+        return 0;
+    }
+    return sum->rhs->val;
+}
+
+// Returns the induction variable of |node| if it is a loop of the form
+// "for (...; i < n; i += s)" with s > 0, n loop-invariant, and a body that
+// never writes i. Sets |*step| to s.
+static Var *counted_loop_var(Node *node, int *step) {
+    Node *cond = node->cond;
+    if (!cond || (cond->kind != NODE_LT && cond->kind != NODE_LE)
+        || cond->lhs->kind != NODE_VAR || !is_integer(cond->lhs->ty)
+        || !is_tracked(cond->lhs->var)) {
+        return NULL;
+    }
+    Var *iv = cond->lhs->var;
+
+    Node *bound = cond->rhs;
+    if (bound->kind == NODE_VAR) {
+        if (bound->var == iv || !is_tracked(bound->var)
+            || !is_integer(bound->ty) || assigns_var(node->then, bound->var)) {
+            return NULL;
+        }
+    }
+    else if (bound->kind != NODE_NUM) {
+        return NULL;
+    }
+
+    int s = node->inc ? var_increment(node->inc->lhs, iv) : 0;
+    if (s <= 0 || assigns_var(node->then, iv)) {
+        return NULL;
+    }
+    *step = s;
+    return iv;
+}
+
+// Replaces a loop with a constant trip count by copies of its body.
+static bool generate_fully_unrolled_for(Node *node) {
+    int step;
+    Var *iv = counted_loop_var(node, &step);
+    if (!iv || node->cond->rhs->kind != NODE_NUM || !node->init
+        || node->init->lhs->kind != NODE_ASSIGN
+        || node->init->lhs->lhs->kind != NODE_VAR
+        || node->init->lhs->lhs->var != iv
+        || node->init->lhs->rhs->kind != NODE_NUM) {
+        return false;
+    }
+
+    long start = node->init->lhs->rhs->val;
+    long end = node->cond->rhs->val;
+    if (node->cond->kind == NODE_LE) {
+        ++end;
+    }
+    long trips = start < end ? (end - start + step - 1) / step : 0;
+    int size = count_nodes(node->then) + count_nodes(node->inc);
+    if (trips > FULL_UNROLL_MAX_TRIPS || trips * size > UNROLL_BUDGET) {
+        return false;
+    }
+
+    generate_statement(node->init);
+    for (long i = 0; i < trips; ++i) {
+        generate_statement(node->then);
+        generate_statement(node->inc);
+    }
+    return true;
+}
+
+// Emits a loop running |opt_unroll_factor| copies of the body per test in
+// front of the scalar loop at .L.begin.|seq|.
+static void generate_partially_unrolled_for(Node *node, int seq) {
+    int factor = opt_unroll_factor;
+    int step;
+    if (factor < 2 || !counted_loop_var(node, &step)
+        || contains_kind(node->then, NODE_FOR)) {
+        return;
+    }
+    int size = count_nodes(node->then) + count_nodes(node->inc);
+    // The guard compares against (factor - 1) * s as a 32-bit immediate.
+    long last = (long)(factor - 1) * step;
+    if (factor * size > UNROLL_BUDGET || last > INT32_MAX) {
+        return;
+    }
+
+    // Test that the last of the |factor| iterations still satisfies the
+    // loop condition, i.e. i + (factor - 1) * s < n. That sum may overflow
+    // for a long i, so test i < n and then n - i > (factor - 1) * s, where
+    // n - i is exact as an unsigned number.
+    Node diff = {
+        .kind = NODE_SUB, .lhs = node->cond->rhs, .rhs = node->cond->lhs,
+    };
+
+    emit(".L.ubegin.%s.%d:\n", funcname, seq);
+    generate_branch(node->cond, false, "begin", seq);
+    generate_asm(&diff);
+    emit("  cmp %s, %ld\n", reg(--top), last);
+    emit("  j%s .L.begin.%s.%d\n",
+        node->cond->kind == NODE_LT ? "be" : "b", funcname, seq);
+    for (int i = 0; i < factor; ++i) {
+        generate_statement(node->then);
+        generate_statement(node->inc);
+    }
+    emit("  jmp .L.ubegin.%s.%d\n", funcname, seq);
+}
+
+// A path taken fewer than 1/COLD_RATIO times as often as its alternative
+// moves out of line.
+#define COLD_RATIO 20
+// Loops with fewer iterations per entry are not unrolled or vectorized.
+#define MIN_HOT_TRIPS 8
+
+// Counts a pass over edge |id| of the current function.
+static void count_edge(int id) {
+    emit("  inc qword ptr [rip+.L.prof.%s+%d]\n", funcname, id * 8);
+}
+
+// Returns whether a path taken |count| times is cold next to one taken
+// |other| times, and is not already out of line.
+static bool is_cold(long count, long other) {
+    return output_file != cold_file && count * COLD_RATIO < other;
+}
+
+// Emits |node| out of line at .L.|label|.|seq|, jumping back to .L.end.|seq|
+// when done.
+static void generate_cold(Node *node, char *label, int seq) {
+    FILE *out = output_file;
+    output_file = cold_file;
+    emit(".L.%s.%s.%d:\n", label, funcname, seq);
+    generate_statement(node);
+    emit("  jmp  .L.end.%s.%d\n", funcname, seq);
+    output_file = out;
+}
+
+// Emits an if statement with the path taken more often in the profile
+// falling through, and a cold path out of line.
+static void generate_profiled_if(Node *node, int seq) {
+    long then_count = counts[node->counter];
+    long else_count = counts[node->counter + 1];
+    if (then_count < else_count && node->els) {
+        generate_branch(node->cond, true, "then", seq);
+        generate_statement(node->els);
+        if (is_cold(then_count, else_count)) {
+            generate_cold(node->then, "then", seq);
+        }
+        else {
+            emit("  jmp  .L.end.%s.%d\n", funcname, seq);
+            emit(".L.then.%s.%d:\n", funcname, seq);
+            generate_statement(node->then);
+        }
+    }
+    else if (then_count < else_count && is_cold(then_count, else_count)) {
+        generate_branch(node->cond, true, "then", seq);
+        generate_cold(node->then, "then", seq);
+    }
+    else if (node->els && is_cold(else_count, then_count)) {
+        generate_branch(node->cond, false, "else", seq);
+        generate_statement(node->then);
+        generate_cold(node->els, "else", seq);
+    }
+    else if (node->els) {
+        generate_branch(node->cond, false, "else", seq);
+        generate_statement(node->then);
+        emit("  jmp  .L.end.%s.%d\n", funcname, seq);
+        emit(".L.else.%s.%d:\n", funcname, seq);
+        generate_statement(node->els);
+    }
+    else {
+        generate_branch(node->cond, false, "end", seq);
+        generate_statement(node->then);
+    }
+    emit(".L.end.%s.%d:\n", funcname, seq);
+}
+
+// Returns the average number of iterations per entry of the loop |node|
+// in the profile.
+static long average_trips(Node *node) {
+    long iterations = counts[node->counter];
+    long exits = counts[node->counter + 1];
+    return iterations / (exits ? exits : 1);
+}
+
+// Emits a loop that the profile says iterates more than once per entry,
+// with its test at the bottom, so each iteration takes one branch.
+static void generate_rotated_for(Node *node, int seq) {
+    emit("  jmp .L.cond.%s.%d\n", funcname, seq);
+    emit(".L.body.%s.%d:\n", funcname, seq);
+    generate_statement(node->then);
+    if (node->inc) {
+        generate_statement(node->inc);
+    }
+    emit(".L.cond.%s.%d:\n", funcname, seq);
+    generate_branch(node->cond, true, "body", seq);
+}
+
+// Switch statements.
+//
+// A switch dispatches on its sorted case values with a jump table where
+// they are dense, a binary search where they are sparse, and compares one
+// by one once only a few are left. Each half of a binary search is
+// considered again, so a dense cluster among sparse values still gets a
+// table of its own.
+
+// Up to this many cases are compared one by one.
+#define SWITCH_LINEAR_MAX 3
+// A jump table covers at least JUMP_TABLE_MIN cases, which fill at least
+// one in SWITCH_DENSITY of its entries.
+#define JUMP_TABLE_MIN 4
+#define SWITCH_DENSITY 3
+
+// Sequence number of the innermost switch being generated.
+static _Thread_local int switch_seq;
+
+// Emits |insn| to the label of case |c|.
+static void jump_to_case(char *insn, Node *c, int seq) {
+    emit("  %s .L.case.%s.%d.%d\n", insn, funcname, seq, c->case_id);
+}
+
+// Emits |insn| to the default label of |sw|, or past it if it has none.
+static void jump_to_default(char *insn, Node *sw, int seq) {
+    emit("  %s .L.%s.%s.%d\n", insn, sw->default_case ? "default" : "break",
+        funcname, seq);
+}
+
+// Emits a jump through a table for cases[lo..hi) of |sw| on the value in
+// |r|. The entries are offsets from the table, which follows the jump.
+static void generate_jump_table(Node *sw, int lo, int hi, char *r, int seq) {
+    int table = labelseq++;
+    long min = sw->cases[lo]->val;
+    long max = sw->cases[hi - 1]->val;
+    emit("  mov rax, %s\n", r);
+    emit("  sub rax, %ld\n", min);
+    emit("  cmp rax, %ld\n", max - min);
+    jump_to_default("ja", sw, seq);
+    emit("  lea rdx, [rip+.L.table.%s.%d]\n", funcname, table);
+    emit("  movsxd rax, dword ptr [rdx+rax*4]\n");
+    emit("  add rax, rdx\n");
+    emit("  jmp rax\n");
+    emit(".L.table.%s.%d:\n", funcname, table);
+    int i = lo;
+    for (long v = min; v <= max; ++v) {
+        if (sw->cases[i]->val == v) {
+            emit("  .long .L.case.%s.%d.%d - .L.table.%s.%d\n", funcname, seq,
+                sw->cases[i++]->case_id, funcname, table);
+        }
+        else {
+            emit("  .long .L.%s.%s.%d - .L.table.%s.%d\n",
+                sw->default_case ? "default" : "break", funcname, seq,
+                funcname, table);
+        }
+    }
+}
+
+// Emits the dispatch to cases[lo..hi) of |sw| on the value in |r|.
+static void generate_dispatch(Node *sw, int lo, int hi, char *r, int seq) {
+    int n = hi - lo;
+    if (n <= SWITCH_LINEAR_MAX) {
+        for (int i = lo; i < hi; ++i) {
+            emit("  cmp %s, %d\n", r, sw->cases[i]->val);
+            jump_to_case("je", sw->cases[i], seq);
+        }
+        jump_to_default("jmp", sw, seq);
+        return;
+    }
+    long range = (long)sw->cases[hi - 1]->val - sw->cases[lo]->val + 1;
+    if (n >= JUMP_TABLE_MIN && range <= (long)n * SWITCH_DENSITY) {
+        generate_jump_table(sw, lo, hi, r, seq);
+        return;
+    }
+    int mid = lo + n / 2;
+    int right = labelseq++;
+    emit("  cmp %s, %d\n", r, sw->cases[mid]->val);
+    jump_to_case("je", sw->cases[mid], seq);
+    emit("  jg .L.right.%s.%d\n", funcname, right);
+    generate_dispatch(sw, lo, mid, r, seq);
+    emit(".L.right.%s.%d:\n", funcname, right);
+    generate_dispatch(sw, mid + 1, hi, r, seq);
+}
+
 static void generate_statement(Node *node) {
+    if (opt_line_tables && node->kind != NODE_BLOCK) {
+        emit("  .loc 1 %d\n", node->tok->line);
+    }
     if (node->kind == NODE_EXPR_STATEMENT) {
-        generate_asm(node->lhs);
-        --top;
+        if (is_compound_assign(node->lhs->kind)) {
+            generate_compound_assign(node->lhs, false);
+        }
+        else {
+            generate_asm(node->lhs);
+            --top;
+        }
     }
     else if (node->kind == NODE_RETURN) {
         generate_asm(node->lhs);
         // RAX represents program exit code.
-        printf("  mov rax, %s\n", reg(--top));
-        printf("  jmp .L.return.%s\n", funcname);
+        emit("  mov rax, %s\n", reg(--top));
+        emit("  jmp .L.return.%s\n", funcname);
         return;
     }
     else if (node->kind == NODE_IF) {
         int seq = labelseq++;
-        if (node->els) {
-            generate_asm(node->cond);
-            printf("  cmp %s, 0\n", reg(--top));
-            printf("  je   .L.else.%d\n", seq);
+        if (counts) {
+            generate_profiled_if(node, seq);
+        }
+        else if (node->els || opt_profile_generate) {
+            generate_branch(node->cond, false, "else", seq);
+            if (opt_profile_generate) {
+                count_edge(node->counter);
+            }
             generate_statement(node->then);
-            printf("  jmp  .L.end.%d\n", seq);
-            printf(".L.else.%d:\n", seq);
-            generate_statement(node->els);
-            printf(".L.end.%d:\n", seq);
+            emit("  jmp  .L.end.%s.%d\n", funcname, seq);
+            emit(".L.else.%s.%d:\n", funcname, seq);
+            if (opt_profile_generate) {
+                count_edge(node->counter + 1);
+            }
+            if (node->els) {
+                generate_statement(node->els);
+            }
+            emit(".L.end.%s.%d:\n", funcname, seq);
         }
         else {
-            generate_asm(node->cond);
-            printf("  cmp %s, 0\n", reg(--top));
-            printf("  je   .L.end.%d\n", seq);
+            generate_branch(node->cond, false, "end", seq);
             generate_statement(node->then);
-            printf(".L.end.%d:\n", seq);
+            emit(".L.end.%s.%d:\n", funcname, seq);
         }
     }
     else if (node->kind == NODE_FOR) {
+        // Instrumented loops stay as written, so that they count every
+        // iteration, and loops the profile shows to be cold or short are
+        // not worth growing.
+        bool transform = !opt_profile_generate;
+        if (counts) {
+            transform = counts[0] > 0 && counts[node->counter] > 0;
+        }
+        if (transform && opt_unroll_factor > 0
+            && generate_fully_unrolled_for(node)) {
+            return;
+        }
         int seq = labelseq++;
         if (node->init) {
             generate_statement(node->init);
         }
-        printf(".L.begin.%d:\n", seq);
+        if (transform && (!counts || average_trips(node) >= MIN_HOT_TRIPS)
+            && !generate_loop_idiom(node, funcname, seq)
+            && !vectorize_loop(node, funcname, seq)) {
+            generate_partially_unrolled_for(node, seq);
+        }
+        emit(".L.begin.%s.%d:\n", funcname, seq);
+        if (counts && node->cond && average_trips(node) > 1) {
+            generate_rotated_for(node, seq);
+            emit(".L.end.%s.%d:\n", funcname, seq);
+            return;
+        }
         if (node->cond) {
-            generate_asm(node->cond);
-            printf("  cmp %s, 0\n", reg(--top));
-            printf("  je  .L.end.%d\n", seq);
+            generate_branch(node->cond, false, "end", seq);
+        }
+        if (opt_profile_generate) {
+            count_edge(node->counter);
         }
         generate_statement(node->then);
         if (node->inc) {
             generate_statement(node->inc);
         }
-        printf("  jmp .L.begin.%d\n", seq);
-        printf(".L.end.%d:\n", seq);
+        emit("  jmp .L.begin.%s.%d\n", funcname, seq);
+        emit(".L.end.%s.%d:\n", funcname, seq);
+        if (opt_profile_generate) {
+            count_edge(node->counter + 1);
+        }
     }
     else if (node->kind == NODE_BLOCK) {
         for (Node *n = node->body; n; n = n->next) {
             generate_statement(n);
         }
     }
+    else if (node->kind == NODE_SWITCH) {
+        int seq = labelseq++;
+        generate_asm(node->cond);
+        generate_dispatch(node, 0, node->ncases, reg(--top), seq);
+        int outer = switch_seq;
+        switch_seq = seq;
+        generate_statement(node->then);
+        switch_seq = outer;
+        emit(".L.break.%s.%d:\n", funcname, seq);
+    }
+    else if (node->kind == NODE_CASE) {
+        if (node->case_id < 0) {
+            emit(".L.default.%s.%d:\n", funcname, switch_seq);
+        }
+        else {
+            emit(".L.case.%s.%d.%d:\n", funcname, switch_seq, node->case_id);
+        }
+        generate_statement(node->lhs);
+    }
+    else if (node->kind == NODE_BREAK) {
+        emit("  jmp .L.break.%s.%d\n", funcname, switch_seq);
+    }
     else {
         error("%s is invalid statement", node->tok->token_string);
     }
 }
 
+static void generate_function(Function *fn) {
+    emit(".global %s\n", fn->name);
+    emit("%s:\n", fn->name);
+    funcname = fn->name;
+    // Labels are numbered per function, so that functions can be generated
+    // in any order, on any thread, with the same result.
+    labelseq = 1;
+    // Prologue. r12-15 are callee-saved registers.
+    emit("  push rbp\n");
+    emit("  mov rbp, rsp\n");
+    emit("  sub rsp, %d\n", fn->stack_size);
+    emit("  mov [rbp-8], r12\n");
+    emit("  mov [rbp-16], r13\n");
+    emit("  mov [rbp-24], r14\n");
+    emit("  mov [rbp-32], r15\n");
 
-void codegen(Function *prog) {
-    // Print out the first half of assembly.
-    printf(".intel_syntax noprefix\n");
+    counts = NULL;
+    if (opt_profile_generate || opt_profile_use) {
+        fn->ncounters = assign_counters(fn);
+    }
+    if (opt_profile_generate) {
+        count_edge(0);
+    }
+    if (opt_profile_use) {
+        counts = find_profile(opt_profile_use, fn, fn->ncounters);
+    }
+    char *cold;
+    size_t cold_len;
+    cold_file = counts ? open_memstream(&cold, &cold_len) : NULL;
+
+    // Save arguments to the stack
+    int i = 0;
+    for (Var *var = fn->params; var; var = var->next) {
+        ++i;
+    }
+    for (Var *var = fn->params; var; var = var->next) {
+        --i;
+        emit("  mov [rbp-%d], %s\n",
+            var->offset, sized_argreg(i, var->ty->size));
+    }
+
+    // Traverse the AST to emit assembly.
+    for (Node *n = fn->node; n; n = n->next) {
+        generate_statement(n);
+        assert(top == 0);
+    }
+
+    // Epilogue
+    emit(".L.return.%s:\n", funcname);
+    emit("  mov r12, [rbp-8]\n");
+    emit("  mov r13, [rbp-16]\n");
+    emit("  mov r14, [rbp-24]\n");
+    emit("  mov r15, [rbp-32]\n");
+    emit("  mov rsp, rbp\n");
+    emit("  pop rbp\n");
+    emit("  ret\n");
+
+    if (cold_file) {
+        fclose(cold_file);
+        fwrite(cold, 1, cold_len, output_file);
+        free(cold);
+        cold_file = NULL;
+    }
+    if (opt_profile_generate) {
+        emit(".bss\n");
+        emit(".align 8\n");
+        emit(".L.prof.%s:\n", funcname);
+        emit("  .zero %d\n", fn->ncounters * 8);
+        emit(".text\n");
+    }
+}
+
+// Reads the |size|-byte integer at |p|.
+static long read_int(char *p, int size) {
+    if (size == 1) {
+        return (signed char)*p;
+    }
+    if (size == 2) {
+        int16_t val;
+        memcpy(&val, p, 2);
+        return val;
+    }
+    if (size == 4) {
+        int32_t val;
+        memcpy(&val, p, 4);
+        return val;
+    }
+    int64_t val;
+    memcpy(&val, p, 8);
+    return val;
+}
+
+// Emits the global variable |var|. Constants go into .rodata, variables
+// that start out as all zeros into .bss, and the others into .data.
+static void generate_global(Var *var) {
+    Type *ty = var->ty;
+    int size = ty->size;
+    char *data = var->init_data;
+    int end = data ? size : 0;
+    while (end > 0 && !data[end - 1]) {
+        --end;
+    }
+
+    if (var->is_const) {
+        emit(".section .rodata\n");
+    }
+    else if (end > 0) {
+        emit(".data\n");
+    }
+    else {
+        emit(".bss\n");
+    }
+    // Code refers to the global through a local alias, since GNU as would
+    // read a global named like a register, such as di, as that register.
+    emit(".global %s\n", var->name);
+    emit(".align %d\n", ty->align);
+    emit(".L.global.%s:\n", var->name);
+    emit("%s:\n", var->name);
+
+    // Initialized elements one by one, then the zeros after them.
+    while (ty->kind == TY_ARRAY) {
+        ty = ty->base;
+    }
+    static char *directives[] = { [1] = "byte", [2] = "short", [4] = "long",
+        [8] = "quad" };
+    int unit = ty->size;
+    int i = 0;
+    for (; i < end; i += unit) {
+        emit("  .%s %ld\n", directives[unit], read_int(data + i, unit));
+    }
+    if (i < size) {
+        emit("  .zero %d\n", size - i);
+    }
+    emit(".text\n");
+}
+
+// Generates |fn|, or copies its code from the compilation cache, and
+// stores newly generated code in the cache if it is in use.
+static void generate_function_cached(Function *fn) {
+    if (fn->var) {
+        generate_global(fn->var);
+        return;
+    }
+    if (fn->cached_asm) {
+        fputs(fn->cached_asm, output_file);
+        return;
+    }
+    if (!fn->cache_key) {
+        generate_function(fn);
+        return;
+    }
+
+    FILE *out = output_file;
+    char *buf;
+    size_t buflen;
+    output_file = open_memstream(&buf, &buflen);
+    generate_function(fn);
+    fclose(output_file);
+    output_file = out;
+
+    cache_store(fn->cache_key, buf, buflen);
+    fwrite(buf, 1, buflen, output_file);
+    free(buf);
+}
+
+// Emits |fn| and records how many instructions it took.
+static void emit_function(Function *fn) {
+    Phase prev = enter_phase(PHASE_CODEGEN);
+    long n = ninstructions;
+    generate_function_cached(fn);
+    n = fn->cached_asm ? count_instructions(fn->cached_asm)
+        : ninstructions - n;
+    if (!fn->var) {
+        record_function_stats(fn->name, n);
+    }
+    enter_phase(prev);
+}
+
+// Work queue for generating the functions of a program in parallel. Each
+// worker takes the next function and generates it into its own buffer.
+typedef struct Job Job;
+struct Job {
+    Function *fn;
+    char *buf;
+    size_t buflen;
+};
+
+typedef struct JobQueue JobQueue;
+struct JobQueue {
+    Job *jobs;
+    int njobs;
+    int next;
+    CodegenOptions options;
+    pthread_mutex_t lock;
+};
+
+static void *codegen_worker(void *arg) {
+    JobQueue *q = arg;
+    restore_codegen_options(q->options);
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        int i = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        if (i >= q->njobs) {
+            return NULL;
+        }
+        Job *job = &q->jobs[i];
+        output_file = open_memstream(&job->buf, &job->buflen);
+        emit_function(job->fn);
+        fclose(output_file);
+    }
+}
+
+// Generates the functions of |prog| on up to |nthreads| threads, then
+// writes them out in source order.
+static void generate_functions_parallel(Function *prog, int nthreads) {
+    JobQueue q = {
+        .options = save_codegen_options(),
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+    };
     for (Function *fn = prog; fn; fn = fn->next) {
-        printf(".global %s\n", fn->name);
-        printf("%s:\n", fn->name);
-        funcname = fn->name;
-        // Prologue. r12-15 are callee-saved registers.
-        printf("  push rbp\n");
-        printf("  mov rbp, rsp\n");
-        printf("  sub rsp, %d\n", fn->stack_size);
-        printf("  mov [rbp-8], r12\n");
-        printf("  mov [rbp-16], r13\n");
-        printf("  mov [rbp-24], r14\n");
-        printf("  mov [rbp-32], r15\n");
-
-        // Save arguments to the stack
-        int i = 0;
-        for (Var *var = fn->params; var; var = var->next) {
-            ++i;
-        }
-        for (Var *var = fn->params; var; var = var->next) {
-            printf("  mov [rbp-%d], %s\n", var->offset, argreg[--i]);
-        }
-
-        // Traverse the AST to emit assembly.
-        for (Node *n = fn->node; n; n = n->next) {
-            generate_statement(n);
-            assert(top == 0);
+        ++q.njobs;
+    }
+    q.jobs = calloc(q.njobs, sizeof(Job));
+    int i = 0;
+    for (Function *fn = prog; fn; fn = fn->next) {
+        q.jobs[i++].fn = fn;
+    }
+
+    if (nthreads > q.njobs) {
+        nthreads = q.njobs;
+    }
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    for (i = 0; i < nthreads; ++i) {
+        if (pthread_create(&threads[i], NULL, codegen_worker, &q)) {
+            error("cannot create a thread");
+        }
+    }
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    for (i = 0; i < q.njobs; ++i) {
+        fwrite(q.jobs[i].buf, 1, q.jobs[i].buflen, output_file);
+        free(q.jobs[i].buf);
+    }
+    free(q.jobs);
+}
+
+// Emits a destructor that appends the counters of the functions in |prog|
+// to the profile. Each function's counters are listed in a table of
+// (name, counters, number of counters).
+static void generate_profile_dump(Function *prog) {
+    emit(".section .rodata\n");
+    emit(".L.profile.path:\n");
+    emit("  .string \"");
+    for (char *p = opt_profile_generate; *p; ++p) {
+        emit(*p == '"' || *p == '\\' ? "\\%c" : "%c", *p);
+    }
+    emit("\"\n");
+    emit(".L.profile.mode:\n");
+    emit("  .string \"a\"\n");
+    emit(".L.profile.format:\n");
+    emit("  .string \"%%s %%d %%ld\\n\"\n");
+    for (Function *fn = prog; fn; fn = fn->next) {
+        if (!fn->var) {
+            emit(".L.profile.name.%s:\n", fn->name);
+            emit("  .string \"%s\"\n", fn->name);
         }
+    }
+    emit(".data\n");
+    emit(".align 8\n");
+    emit(".L.profile.table:\n");
+    for (Function *fn = prog; fn; fn = fn->next) {
+        if (!fn->var) {
+            emit("  .quad .L.profile.name.%s, .L.prof.%s, %d\n",
+                fn->name, fn->name, fn->ncounters);
+        }
+    }
+    emit("  .quad 0\n");
+    emit(".section .fini_array,\"aw\"\n");
+    emit(".align 8\n");
+    emit("  .quad .L.profile.dump\n");
+    emit(".text\n");
+
+    // rbx holds the FILE, r12 the table entry and r13 the counter.
+    emit(".L.profile.dump:\n");
+    emit("  push rbx\n");
+    emit("  push r12\n");
+    emit("  push r13\n");
+    emit("  lea rdi, [rip+.L.profile.path]\n");
+    emit("  lea rsi, [rip+.L.profile.mode]\n");
+    emit("  call fopen@PLT\n");
+    emit("  test rax, rax\n");
+    emit("  je .L.profile.done\n");
+    emit("  mov rbx, rax\n");
+    emit("  lea r12, [rip+.L.profile.table]\n");
+    emit(".L.profile.function:\n");
+    emit("  cmp qword ptr [r12], 0\n");
+    emit("  je .L.profile.close\n");
+    emit("  xor r13, r13\n");
+    emit(".L.profile.counter:\n");
+    emit("  cmp r13, [r12+16]\n");
+    emit("  jge .L.profile.next\n");
+    emit("  mov rdi, rbx\n");
+    emit("  lea rsi, [rip+.L.profile.format]\n");
+    emit("  mov rdx, [r12]\n");
+    emit("  mov rcx, r13\n");
+    emit("  mov r8, [r12+8]\n");
+    emit("  mov r8, [r8+r13*8]\n");
+    emit("  xor eax, eax\n");
+    emit("  call fprintf@PLT\n");
+    emit("  inc r13\n");
+    emit("  jmp .L.profile.counter\n");
+    emit(".L.profile.next:\n");
+    emit("  add r12, 24\n");
+    emit("  jmp .L.profile.function\n");
+    emit(".L.profile.close:\n");
+    emit("  mov rdi, rbx\n");
+    emit("  call fclose@PLT\n");
+    emit(".L.profile.done:\n");
+    emit("  pop r13\n");
+    emit("  pop r12\n");
+    emit("  pop rbx\n");
+    emit("  ret\n");
+}
 
-        // Epilogue
-        printf(".L.return.%s:\n", funcname);
-        printf("  mov r12, [rbp-8]\n");
-        printf("  mov r13, [rbp-16]\n");
-        printf("  mov r14, [rbp-24]\n");
-        printf("  mov r15, [rbp-32]\n");
-        printf("  mov rsp, rbp\n");
-        printf("  pop rbp\n");
-        printf("  ret\n");
+// Starts writing assembly to |out|. Streaming compilation then writes one
+// function at a time with codegen_function().
+void codegen_begin(FILE *out) {
+    output_file = out;
+    // An error may have left a compile server thread in any state.
+    top = 0;
+    // Print out the first half of assembly.
+    emit(".intel_syntax noprefix\n");
+    // Programs given on the command line, and the compile server's, have
+    // no file name for the line table.
+    if (opt_line_tables) {
+        char *name = get_input_name(get_current_input());
+        emit(".file 1 \"%s\"\n", name ? name : "-");
+    }
+}
+
+void codegen_function(Function *fn) {
+    emit_function(fn);
+}
+
+// Writes the assembly for |prog| to |out|, generating functions on up to
+// |nthreads| threads. The output does not depend on |nthreads|.
+void codegen(Function *prog, FILE *out, int nthreads) {
+    codegen_begin(out);
+    if (nthreads > 1 && prog && prog->next) {
+        generate_functions_parallel(prog, nthreads);
     }
-}
\ No newline at end of file
+    else {
+        for (Function *fn = prog; fn; fn = fn->next) {
+            emit_function(fn);
+        }
+    }
+    if (opt_profile_generate) {
+        generate_profile_dump(prog);
+    }
+}
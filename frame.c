@@ -0,0 +1,229 @@
+#include "y3c.h"
+
+// Stack frame layout.
+//
+// Every local variable gets a live range, measured in AST nodes visited in
+// evaluation order. Variables whose ranges do not overlap share a stack
+// slot. A variable referenced inside a loop is live for the whole loop,
+// since its value may be carried from one iteration to the next, and a
+// variable whose address may escape is live for the whole function.
+
+typedef struct Range Range;
+struct Range {
+    Var *var;
+    int index;     // Position in fn->locals, to keep the sort stable
+    int begin;
+    int end;
+    Range *next;   // Next member of the same slot
+};
+
+typedef struct Slot Slot;
+struct Slot {
+    int size;
+    int align;
+    Range *members;
+};
+
+static _Thread_local Range *ranges;
+static _Thread_local int nranges;
+static _Thread_local int pos;
+
+static int align_to(int n, int align) {
+    return (n + align - 1) / align * align;
+}
+
+static void extend(Range *r, int begin, int end) {
+    if (begin < r->begin) {
+        r->begin = begin;
+    }
+    if (end > r->end) {
+        r->end = end;
+    }
+}
+
+// While ranges are computed, Var::offset holds the index into |ranges|.
+static void touch(Var *var) {
+    extend(&ranges[var->offset], pos, pos);
+}
+
+static void escape(Var *var) {
+    extend(&ranges[var->offset], 0, INT32_MAX);
+}
+
+static void walk(Node *node, bool is_base);
+
+// Returns the local whose storage the lvalue |node| lies in, or NULL. The
+// parser puts the pointer operand of a pointer addition on the left.
+static Var *root_var(Node *node) {
+    while (node->kind == NODE_DEREFERENCE || node->kind == NODE_ADD
+        || node->kind == NODE_SUB) {
+        node = node->lhs;
+    }
+    if (node->kind != NODE_VAR || node->var->is_global) {
+        return NULL;
+    }
+    return node->var;
+}
+
+static void walk_list(Node *node) {
+    for (Node *n = node; n; n = n->next) {
+        walk(n, false);
+    }
+}
+
+// |is_base| is true if |node| is the array operand of x[i] or *x, which is
+// the only way an array can be used without its address escaping.
+static void walk(Node *node, bool is_base) {
+    if (!node) {
+        return;
+    }
+    ++pos;
+
+    // Globals have no place in the frame.
+    if (node->kind == NODE_VAR && node->var->is_global) {
+        return;
+    }
+    if (node->kind == NODE_VAR) {
+        if (node->var->is_address_taken
+            || (node->ty->kind == TY_ARRAY && !is_base)) {
+            escape(node->var);
+        }
+        touch(node->var);
+        return;
+    }
+    if (node->kind == NODE_DEREFERENCE) {
+        Node *addr = node->lhs;
+        if (addr->kind == NODE_ADD) {
+            ++pos;
+            walk(addr->lhs, true);
+            walk(addr->rhs, false);
+        }
+        else {
+            walk(addr, true);
+        }
+        return;
+    }
+    // &x[i] lets x escape just like &x does.
+    if (node->kind == NODE_ADDRESS) {
+        walk(node->lhs, false);
+        Var *var = root_var(node->lhs);
+        if (var) {
+            escape(var);
+        }
+        return;
+    }
+    if (node->kind == NODE_FOR) {
+        walk(node->init, false);
+        int begin = pos;
+        walk(node->cond, false);
+        walk(node->then, false);
+        walk(node->inc, false);
+        for (int i = 0; i < nranges; ++i) {
+            Range *r = &ranges[i];
+            if (r->begin <= pos && begin <= r->end) {
+                extend(r, begin, pos);
+            }
+        }
+        return;
+    }
+
+    walk(node->lhs, false);
+    walk(node->rhs, false);
+    walk(node->cond, false);
+    walk(node->then, false);
+    walk(node->els, false);
+    walk(node->init, false);
+    walk(node->inc, false);
+    walk_list(node->body);
+    walk_list(node->args);
+}
+
+// Larger alignments first, then larger sizes, then declaration order.
+static int compare_ranges(const void *a, const void *b) {
+    Range *x = *(Range **)a;
+    Range *y = *(Range **)b;
+    if (x->var->ty->align != y->var->ty->align) {
+        return y->var->ty->align - x->var->ty->align;
+    }
+    if (x->var->ty->size != y->var->ty->size) {
+        return y->var->ty->size - x->var->ty->size;
+    }
+    return x->index - y->index;
+}
+
+static bool fits(Slot *slot, Range *r) {
+    for (Range *m = slot->members; m; m = m->next) {
+        if (m->begin <= r->end && r->begin <= m->end) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Assigns offsets to the local variables of |fn| and sets its stack size.
+void layout_frame(Function *fn) {
+    Phase prev = enter_phase(PHASE_LAYOUT);
+    int offset = 32; // 32 for callee-saved registers
+
+    nranges = 0;
+    for (Var *var = fn->locals; var; var = var->next) {
+        ++nranges;
+    }
+    ranges = calloc(nranges, sizeof(Range));
+    Range **sorted = calloc(nranges, sizeof(Range *));
+    int i = 0;
+    for (Var *var = fn->locals; var; var = var->next, ++i) {
+        ranges[i] = (Range) { var, i, INT32_MAX, -1, NULL };
+        sorted[i] = &ranges[i];
+        var->offset = i;
+    }
+
+    // Parameters are live from the prologue on.
+    for (Var *var = fn->params; var; var = var->next) {
+        extend(&ranges[var->offset], 0, 0);
+    }
+    pos = 0;
+    walk_list(fn->node);
+
+    if (opt_stack_coloring) {
+        qsort(sorted, nranges, sizeof(Range *), compare_ranges);
+    }
+
+    Slot *slots = calloc(nranges, sizeof(Slot));
+    int nslots = 0;
+    for (i = 0; i < nranges; ++i) {
+        Range *r = sorted[i];
+        Slot *slot = NULL;
+        if (opt_stack_coloring) {
+            for (int j = 0; j < nslots && !slot; ++j) {
+                if (fits(&slots[j], r)) {
+                    slot = &slots[j];
+                }
+            }
+        }
+        if (!slot) {
+            slot = &slots[nslots++];
+        }
+        if (r->var->ty->size > slot->size) {
+            slot->size = r->var->ty->size;
+        }
+        if (r->var->ty->align > slot->align) {
+            slot->align = r->var->ty->align;
+        }
+        r->next = slot->members;
+        slot->members = r;
+    }
+
+    for (i = 0; i < nslots; ++i) {
+        offset = align_to(offset + slots[i].size, slots[i].align);
+        for (Range *r = slots[i].members; r; r = r->next) {
+            r->var->offset = offset;
+        }
+    }
+    fn->stack_size = align_to(offset, 16);
+
+    free(slots);
+    free(sorted);
+    free(ranges);
+    enter_phase(prev);
+}
@@ -1,28 +1,421 @@
 #include "y3c.h"
 
-static int align_to(int n, int align) {
-    return (n + align - 1) / align * align;
+#include <pthread.h>
+#include <unistd.h>
+
+// Code generation options are per thread, since the compile server serves
+// requests with different options at once. Threads that work on a part of
+// a compilation take them over with save_codegen_options() and
+// restore_codegen_options().
+
+// Use 256-bit AVX2 instead of SSE2 when vectorizing loops.
+_Thread_local bool opt_avx2;
+// Copies of a loop body per iteration of partially unrolled loops. 0
+// disables unrolling altogether and 1 leaves only full unrolling.
+_Thread_local int opt_unroll_factor = 4;
+// Let locals with disjoint live ranges share stack slots.
+_Thread_local bool opt_stack_coloring = true;
+// Where instrumented code writes its profile, or NULL for no
+// instrumentation.
+_Thread_local char *opt_profile_generate;
+// The profile to optimize for, or NULL.
+_Thread_local Profile *opt_profile_use;
+// Emit .file and .loc directives that map instructions to source lines.
+_Thread_local bool opt_line_tables;
+
+// Resets the options that affect code generation to their defaults.
+void reset_codegen_options(void) {
+    opt_avx2 = false;
+    opt_unroll_factor = 4;
+    opt_stack_coloring = true;
+    opt_profile_generate = NULL;
+    opt_profile_use = NULL;
+    opt_line_tables = false;
+}
+
+CodegenOptions save_codegen_options(void) {
+    return (CodegenOptions) {
+        opt_avx2, opt_unroll_factor, opt_stack_coloring,
+        opt_profile_generate, opt_profile_use, opt_line_tables,
+    };
+}
+
+void restore_codegen_options(CodegenOptions opts) {
+    opt_avx2 = opts.avx2;
+    opt_unroll_factor = opts.unroll_factor;
+    opt_stack_coloring = opts.stack_coloring;
+    opt_profile_generate = opts.profile_generate;
+    opt_profile_use = opts.profile_use;
+    opt_line_tables = opts.line_tables;
+}
+
+// Applies |arg| if it is a code generation option and returns whether it
+// was one.
+bool parse_codegen_option(char *arg) {
+    if (!strcmp(arg, "-mavx2")) {
+        opt_avx2 = true;
+        return true;
+    }
+    if (!strncmp(arg, "-funroll-factor=", 16)) {
+        opt_unroll_factor = atoi(arg + 16);
+        return true;
+    }
+    if (!strcmp(arg, "-fno-unroll-loops")) {
+        opt_unroll_factor = 0;
+        return true;
+    }
+    if (!strcmp(arg, "-fno-stack-coloring")) {
+        opt_stack_coloring = false;
+        return true;
+    }
+    if (!strcmp(arg, "-fprofile-generate")
+        || !strncmp(arg, "-fprofile-generate=", 19)) {
+        opt_profile_generate = profile_path(arg);
+        return true;
+    }
+    if (!strcmp(arg, "-fprofile-use") || !strncmp(arg, "-fprofile-use=", 14)) {
+        opt_profile_use = load_profile(profile_path(arg));
+        return true;
+    }
+    if (!strcmp(arg, "-g")) {
+        opt_line_tables = true;
+        return true;
+    }
+    return false;
+}
+
+// Rejects code generation options that do not work with how the output
+// is produced: as an object file (|emit_object|), run in-process (|run|)
+// or streamed one function at a time (|stream|).
+void check_codegen_options(char *prog, bool emit_object, bool run,
+    bool stream) {
+    // The built-in assembler cannot relocate the addresses the profile dump
+    // stores in its tables and in .fini_array, and the counters of
+    // streamed functions are gone by the time the profile dump is emitted.
+    if (opt_profile_generate && (emit_object || run || stream)) {
+        error("%s: -fprofile-generate does not work with -c, --run or "
+            "--stream", prog);
+    }
+}
+
+// Reads the whole file at |path| into a NUL-terminated string.
+char *read_file(char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        error("cannot open %s", path);
+    }
+    char *buf;
+    size_t buflen;
+    FILE *out = open_memstream(&buf, &buflen);
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        fwrite(chunk, 1, n, out);
+    }
+    fclose(fp);
+    fclose(out);
+    set_input_name(buf, path);
+    return buf;
+}
+
+// Arguments ending in ".c" name source files. Anything else is the program
+// itself.
+bool is_source_file(char *arg) {
+    size_t len = strlen(arg);
+    return len > 2 && !strcmp(arg + len - 2, ".c");
+}
+
+// Returns |path| with its ".c" suffix replaced by |ext|.
+static char *replace_extension(char *path, char *ext) {
+    size_t len = strlen(path) - 2;
+    char *buf = malloc(len + strlen(ext) + 1);
+    memcpy(buf, path, len);
+    strcpy(buf + len, ext);
+    return buf;
+}
+
+// Compiles |path| to assembly, or to an object file if |emit_object|.
+// Files are compiled in parallel, so each one generates its functions on
+// the calling thread alone.
+static void compile_file(char *path, char *output_path, bool emit_object) {
+    Function *prog = parse(tokenize(read_file(path)), 1);
+    for (Function *fn = prog; fn; fn = fn->next) {
+        layout_frame(fn);
+    }
+
+    if (emit_object) {
+        char *buf;
+        size_t buflen;
+        FILE *out = open_memstream(&buf, &buflen);
+        codegen(prog, out, 1);
+        fclose(out);
+        assemble(buf, output_path);
+        free(buf);
+        return;
+    }
+    FILE *out = fopen(output_path, "w");
+    if (!out) {
+        error("cannot open %s", output_path);
+    }
+    codegen(prog, out, 1);
+    fclose(out);
+}
+
+// Work queue for compiling many files at once. Each worker thread takes the
+// next file until none are left. The compiler's global state is
+// thread-local, so files are compiled independently of each other.
+static char **job_paths;
+static int njobs;
+static int next_job;
+static bool job_emit_object;
+static CodegenOptions job_options;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *compile_worker(void *arg) {
+    (void)arg;
+    restore_codegen_options(job_options);
+    for (;;) {
+        pthread_mutex_lock(&job_lock);
+        int i = next_job++;
+        pthread_mutex_unlock(&job_lock);
+        if (i >= njobs) {
+            return NULL;
+        }
+        char *path = job_paths[i];
+        compile_file(
+            path, replace_extension(path, job_emit_object ? ".o" : ".s"),
+            job_emit_object);
+    }
+}
+
+// Compiles each of |paths| to a file next to it, using up to |nthreads|
+// threads.
+static void compile_files(
+    char **paths, int npaths, int nthreads, bool emit_object) {
+    job_paths = paths;
+    njobs = npaths;
+    next_job = 0;
+    job_emit_object = emit_object;
+    job_options = save_codegen_options();
+
+    if (nthreads > npaths) {
+        nthreads = npaths;
+    }
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    for (int i = 0; i < nthreads; ++i) {
+        if (pthread_create(&threads[i], NULL, compile_worker, NULL)) {
+            error("cannot create a thread");
+        }
+    }
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// parse_stream() callbacks: append_function() collects the program, and
+// compile_function() emits each function right away.
+static void append_function(Function *fn, void *arg) {
+    Function **tail = arg;
+    *tail = (*tail)->next = fn;
+}
+
+static void compile_function(Function *fn, void *arg) {
+    (void)arg;
+    layout_frame(fn);
+    codegen_function(fn);
 }
 
 int main(int argc, char **argv) {
-    if (argc != 2)
+    // Everything after --client=PATH is for the server.
+    if (argc > 1 && !strncmp(argv[1], "--client=", 9)) {
+        return run_client(argv[1] + 9, argv + 2, argc - 2);
+    }
+
+    char **inputs = calloc(argc, sizeof(char *));
+    int ninputs = 0;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *output_path = NULL;
+    bool emit_object = false;
+    bool run = false;
+    bool batch = false;
+    bool pipeline = false;
+    bool stream = false;
+    bool cache_stats = false;
+    char *server_path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--server=", 9)) {
+            server_path = argv[i] + 9;
+            continue;
+        }
+        if (!strncmp(argv[i], "--cache-dir=", 12)) {
+            cache_dir = argv[i] + 12;
+            continue;
+        }
+        if (!strncmp(argv[i], "--cache-size=", 13)) {
+            cache_max_size = atol(argv[i] + 13);
+            continue;
+        }
+        if (!strcmp(argv[i], "--cache-stats")) {
+            cache_stats = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--stats")) {
+            start_stats();
+            continue;
+        }
+        if (!strcmp(argv[i], "--stream")) {
+            stream = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--pipeline")) {
+            pipeline = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--batch")) {
+            batch = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--run")) {
+            run = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "-c")) {
+            emit_object = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "-o")) {
+            if (++i == argc) {
+                error("%s: missing filename after '-o'", argv[0]);
+            }
+            output_path = argv[i];
+            continue;
+        }
+        if (!strncmp(argv[i], "-j", 2)) {
+            nthreads = atoi(argv[i] + 2);
+            if (nthreads < 1) {
+                error("%s: invalid number of jobs: %s", argv[0], argv[i]);
+            }
+            continue;
+        }
+        if (parse_codegen_option(argv[i])) {
+            continue;
+        }
+        if (argv[i][0] == '-' && argv[i][1]) {
+            error("%s: unknown option: %s", argv[0], argv[i]);
+        }
+        inputs[ninputs++] = argv[i];
+    }
+    if (server_path) {
+        if (ninputs > 0) {
+            error("%s: --server takes no inputs", argv[0]);
+        }
+        run_server(server_path, nthreads);
+    }
+    if (ninputs == 0)
         error("%s: invalid number of arguments.", argv[0]);
+    check_codegen_options(argv[0], emit_object, run, stream);
 
-    // Tokenize and parse.
-    Token *tok = tokenize(argv[1]);
-    Function *prog = parse(tok);
-    // Assign offsets to local variables.
-    for (Function *fn = prog; fn; fn = fn->next) {
-        int offset = 32; // 32 for callee-saved registers
-        for (Var *var = fn->locals; var; var = var->next) {
-            offset += var->ty->size;
-            var->offset = offset;
+    // Compile several source files in parallel, each to its own output.
+    if (ninputs > 1) {
+        if (batch || run || output_path) {
+            error("%s: --batch, --run and -o take a single input", argv[0]);
+        }
+        for (int i = 0; i < ninputs; ++i) {
+            if (!is_source_file(inputs[i])) {
+                error("%s: not a .c file: %s", argv[0], inputs[i]);
+            }
+        }
+        compile_files(inputs, ninputs, nthreads, emit_object);
+        if (cache_stats) {
+            print_cache_stats(stderr);
         }
-        fn->stack_size = align_to(offset, 16);
+        if (opt_stats) {
+            print_stats(stderr);
+        }
+        return 0;
+    }
+    char *input = inputs[0];
+
+    // Compile every case of a test manifest into one assembly file.
+    if (batch) {
+        // Cases are renamed after parsing, which cached code cannot follow.
+        if (cache_dir) {
+            error("%s: --batch does not use the cache", argv[0]);
+        }
+        FILE *out = output_path ? fopen(output_path, "w") : stdout;
+        if (!out) {
+            error("%s: cannot open %s", argv[0], output_path);
+        }
+        compile_batch(input, out);
+        fclose(out);
+        if (opt_stats) {
+            print_stats(stderr);
+        }
+        return 0;
     }
 
-    // Traverse the AST to emit assembly.
-    codegen(prog);
+    if (emit_object && !output_path) {
+        error("%s: -c requires -o <file>", argv[0]);
+    }
+    if (is_source_file(input)) {
+        input = read_file(input);
+    }
+
+    // Emit assembly to the output, or to memory if we are going to assemble
+    // it ourselves for an object file or in-process execution.
+    char *buf;
+    size_t buflen;
+    FILE *out = stdout;
+    if (emit_object || run) {
+        out = open_memstream(&buf, &buflen);
+    }
+    else if (output_path) {
+        out = fopen(output_path, "w");
+        if (!out) {
+            error("%s: cannot open %s", argv[0], output_path);
+        }
+    }
 
+    if (stream) {
+        // Compile each function as soon as it is parsed, then free it.
+        TokenStream *s = tokenize_async(input);
+        codegen_begin(out);
+        parse_stream(s, compile_function, NULL, true);
+    }
+    else {
+        // Tokenize and parse. With --pipeline, the lexer runs on its own
+        // thread ahead of the parser.
+        Function *prog;
+        if (pipeline) {
+            Function head = {0};
+            Function *tail = &head;
+            parse_stream(tokenize_async(input), append_function, &tail, false);
+            prog = head.next;
+        }
+        else {
+            prog = parse(tokenize(input), nthreads);
+        }
+        // Assign offsets to local variables.
+        for (Function *fn = prog; fn; fn = fn->next) {
+            layout_frame(fn);
+        }
+        // Traverse the AST to emit assembly.
+        codegen(prog, out, nthreads);
+    }
+    fclose(out);
+    if (cache_stats) {
+        print_cache_stats(stderr);
+    }
+    if (opt_stats) {
+        print_stats(stderr);
+    }
+
+    if (run) {
+        return jit_run(buf);
+    }
+    if (emit_object) {
+        assemble(buf, output_path);
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -1,8 +1,18 @@
 #include "y3c.h"
 
+#include <pthread.h>
+
 // All local variable instances created during parsing are accumulated to this
 // list.
-Var *locals;
+_Thread_local Var *locals;
+// Functions defined so far. Calls to them take their declared return type,
+// and calls to any other function are assumed to return int.
+static _Thread_local Var *functions;
+// Global variables defined so far. Locals shadow them.
+static _Thread_local Var *globals;
+// The innermost switch statement being parsed, which case, default and
+// break belong to. Loops do not support break, so they clear it.
+static _Thread_local Node *current_switch;
 static void print_all_locals() {
     printf("LOCALS: [");
     for (Var *var = locals; var; var = var->next) {
@@ -19,6 +29,8 @@ static Node *statement(Token **rest, Token *tok);
 static Node *expr_statement(Token **rest, Token *tok);
 static Node *expr(Token **rest, Token *tok);
 static Node *assign(Token **rest, Token *tok);
+static Node *logor(Token **rest, Token *tok);
+static Node *logand(Token **rest, Token *tok);
 static Node *equality(Token **rest, Token *tok);
 static Node *relational(Token **rest, Token *tok);
 static Node *add(Token **rest, Token *tok);
@@ -28,7 +40,7 @@ static Node *postfix(Token **rest, Token *tok);
 static Node *primary(Token **rest, Token *tok);
 
 char *mystrndup(const char *s, size_t n) {
-    char *new = (char *)malloc(n + 1);
+    char *new = arena_calloc(n + 1, 1);
     if (new == NULL) {
         return NULL;
     }
@@ -36,8 +48,8 @@ char *mystrndup(const char *s, size_t n) {
     return (char *)memcpy(new, s, n);
 }
 
-static Var *find_var(Token *tok) {
-    for (Var *var = locals; var; var = var->next) {
+static Var *find_in(Var *vars, Token *tok) {
+    for (Var *var = vars; var; var = var->next) {
         if (strlen(var->name) == tok->token_length
             && !strncmp(tok->token_string, var->name, tok->token_length)) {
             return var;
@@ -46,8 +58,18 @@ static Var *find_var(Token *tok) {
     return NULL;
 }
 
+static Var *find_var(Token *tok) {
+    Var *var = find_in(locals, tok);
+    return var ? var : find_in(globals, tok);
+}
+
+static Var *find_function(Token *tok) {
+    return find_in(functions, tok);
+}
+
 static Node *create_new_node(NodeKind kind, Token *tok) {
-    Node *node = calloc(1, sizeof(Node));
+    count_node(kind);
+    Node *node = arena_calloc(1, sizeof(Node));
     node->kind = kind;
     node->tok = tok;
     return node;
@@ -81,7 +103,7 @@ static Node *create_new_var_node(Var *var, Token *tok) {
 }
 
 static Var *create_new_local_var(char *name, Type *ty) {
-    Var *var = calloc(1, sizeof(Var));
+    Var *var = arena_calloc(1, sizeof(Var));
     var->name = name;
     var->ty = ty;
     var->next = locals;
@@ -90,6 +112,19 @@ static Var *create_new_local_var(char *name, Type *ty) {
     return  var;
 }
 
+static Var *create_new_global_var(Type *ty) {
+    if (find_in(globals, ty->name)) {
+        error_tok(ty->name, "duplicate global variable.");
+    }
+    Var *var = arena_calloc(1, sizeof(Var));
+    var->name = mystrndup(ty->name->token_string, ty->name->token_length);
+    var->ty = ty;
+    var->is_global = true;
+    var->next = globals;
+    globals = var;
+    return var;
+}
+
 static char *get_identifier(Token *tok) {
     if (tok->kind != TOKEN_IDENTIFIER) {
         error_tok(tok, "expected an identifier.");
@@ -104,16 +139,31 @@ static int take_number(Token *tok) {
     return tok->val;
 }
 
-// funcdef = typespec declarator multi-statement
-static Function *funcdef(Token **rest, Token *tok) {
+// func-signature = typespec declarator
+//
+// Adds the function to |functions| so that its body and everything after
+// it can call it.
+static Var *func_signature(Token **rest, Token *tok) {
+    Type *ty = typespec(&tok, tok);
+    ty = declarator(rest, tok, ty);
+
+    Var *func = arena_calloc(1, sizeof(Var));
+    func->name = get_identifier(ty->name);
+    func->ty = ty;
+    func->next = functions;
+    functions = func;
+    return func;
+}
+
+// func-body = multi-statement
+static Function *func_body(Token **rest, Token *tok, Var *func) {
     locals = NULL;
+    current_switch = NULL;
 
-    Type *ty = typespec(&tok, tok);
-    ty = declarator(&tok, tok, ty);
+    Function *fn = arena_calloc(1, sizeof(Function));
+    fn->name = func->name;
 
-    Function *fn = calloc(1, sizeof(Function));
-    fn->name = get_identifier(ty->name);
-    for (Type *t = ty->params; t; t = t->next) {
+    for (Type *t = func->ty->params; t; t = t->next) {
         create_new_local_var(get_identifier(t->name), t);
     }
     fn->params = locals;
@@ -128,8 +178,118 @@ static Function *funcdef(Token **rest, Token *tok) {
     return fn;
 }
 
-// typespec = "int"
+// Returns the token after the brace that closes the first top-level "{" at
+// or after |tok|, or NULL if there is none.
+static Token *skip_function(Token *tok) {
+    while (tok->kind != TOKEN_EOF && !equal(tok, "{")) {
+        tok = tok->next;
+    }
+    int depth = 0;
+    for (; tok->kind != TOKEN_EOF; tok = tok->next) {
+        if (equal(tok, "{")) {
+            ++depth;
+        }
+        else if (equal(tok, "}") && --depth == 0) {
+            return tok->next;
+        }
+    }
+    return NULL;
+}
+
+// Looks up the function from |start| to |end| in the compilation cache,
+// after its signature |func| has been parsed. Returns it with its code on a
+// hit. On a miss, returns NULL and sets |*key| to where the code should be
+// stored, or NULL if the cache is not in use.
+static Function *find_cached_function(
+    Token *start, Token *end, Var *func, char **key) {
+    *key = NULL;
+    if (!cache_dir || !end) {
+        return NULL;
+    }
+
+    // The code depends on the function's own tokens, on the return types
+    // of the functions it calls, and on the types of the global variables
+    // it may use. With -g, it also depends on the lines the tokens are on.
+    char *buf;
+    size_t buflen;
+    FILE *out = open_memstream(&buf, &buflen);
+    for (Token *t = start; t != end; t = t->next) {
+        fprintf(out, "%d %.*s", t->kind, (int)t->token_length,
+            t->token_string);
+        if (opt_line_tables) {
+            fprintf(out, " @%d", t->line);
+        }
+        Var *callee = NULL;
+        Var *global = NULL;
+        if (t->kind == TOKEN_IDENTIFIER && equal(t->next, "(")) {
+            callee = find_function(t);
+        }
+        else if (t->kind == TOKEN_IDENTIFIER) {
+            global = find_in(globals, t);
+        }
+        if (callee) {
+            Type *ty = callee->ty->return_ty;
+            fprintf(out, " %d %d", ty->kind, ty->size);
+        }
+        if (global) {
+            fprintf(out, " global %d", global->is_const);
+            for (Type *ty = global->ty; ty; ty = ty->base) {
+                fprintf(out, " %d %d", ty->kind, ty->size);
+            }
+        }
+        fputc('\n', out);
+    }
+    fclose(out);
+    *key = cache_key(buf, buflen);
+    free(buf);
+
+    char *text = cache_lookup(*key);
+    if (!text) {
+        return NULL;
+    }
+    Function *fn = arena_calloc(1, sizeof(Function));
+    fn->name = func->name;
+    fn->cached_asm = text;
+    return fn;
+}
+
+// funcdef = func-signature func-body
+//
+// The body is skipped if the compilation cache has the function's code.
+static Function *funcdef(Token **rest, Token *tok) {
+    Token *start = tok;
+    Var *func = func_signature(&tok, tok);
+    Token *end = cache_dir ? skip_function(tok) : NULL;
+    char *key;
+    Function *fn = find_cached_function(start, end, func, &key);
+    if (fn) {
+        *rest = end;
+        return fn;
+    }
+    fn = func_body(rest, tok, func);
+    fn->cache_key = key;
+    return fn;
+}
+
+static bool is_typename(Token *tok) {
+    return equal(tok, "char") || equal(tok, "short") || equal(tok, "int")
+        || equal(tok, "long");
+}
+
+// typespec = "char" | "short" | "int" | "long"
 static Type *typespec(Token **rest, Token *tok) {
+    if (equal(tok, "char")) {
+        *rest = tok->next;
+        return ty_char;
+    }
+    if (equal(tok, "short")) {
+        *rest = tok->next;
+        return ty_short;
+    }
+    if (equal(tok, "long")) {
+        *rest = tok->next;
+        return ty_long;
+    }
     *rest = skip(tok, "int");
     return ty_int;
 }
@@ -182,7 +342,9 @@ static Type *declarator(Token **rest, Token *tok, Type *ty) {
     if (tok->kind != TOKEN_IDENTIFIER) {
         error_tok(tok, "expected a variable name.");
     }
-    ty = type_suffix(rest, tok->next, ty);
+    // Copy the type before naming it. It may be a shared one like ty_int,
+    // which other threads are naming too.
+    ty = copy_type(type_suffix(rest, tok->next, ty));
     ty->name = tok;
     return ty;
 }
@@ -219,10 +381,176 @@ static Node *declaration(Token **rest, Token *tok) {
     *rest = tok;
     return node;
 }
+
+// Evaluates the constant expression |node|.
+static long eval(Node *node) {
+    switch (node->kind) {
+    case NODE_NUM:
+        return node->val;
+    case NODE_ADD:
+        return eval(node->lhs) + eval(node->rhs);
+    case NODE_SUB:
+        return eval(node->lhs) - eval(node->rhs);
+    case NODE_MUL:
+        return eval(node->lhs) * eval(node->rhs);
+    case NODE_DIV:
+    case NODE_MOD: {
+        long d = eval(node->rhs);
+        if (d == 0) {
+            error_tok(node->tok, "division by zero.");
+        }
+        long n = eval(node->lhs);
+        return node->kind == NODE_DIV ? n / d : n % d;
+    }
+    case NODE_EQ:
+        return eval(node->lhs) == eval(node->rhs);
+    case NODE_NE:
+        return eval(node->lhs) != eval(node->rhs);
+    case NODE_LT:
+        return eval(node->lhs) < eval(node->rhs);
+    case NODE_LE:
+        return eval(node->lhs) <= eval(node->rhs);
+    case NODE_GT:
+        return eval(node->lhs) > eval(node->rhs);
+    case NODE_GE:
+        return eval(node->lhs) >= eval(node->rhs);
+    case NODE_LOGAND:
+        return eval(node->lhs) && eval(node->rhs);
+    case NODE_LOGOR:
+        return eval(node->lhs) || eval(node->rhs);
+    case NODE_NOT:
+        return !eval(node->lhs);
+    default:
+        error_tok(node->tok, "not a compile-time constant.");
+        return 0;
+    }
+}
+
+// initializer = assign | "{" (initializer ("," initializer)* ","?)? "}"
+//
+// Writes the initial value of a global variable of type |ty| to |buf|.
+// Array elements without an initializer stay zero.
+static void initializer(Token **rest, Token *tok, Type *ty, char *buf) {
+    if (ty->kind != TY_ARRAY) {
+        long val = eval(assign(rest, tok));
+        for (int i = 0; i < ty->size; ++i) {
+            buf[i] = val >> (8 * i);
+        }
+        return;
+    }
+
+    tok = skip(tok, "{");
+    for (int i = 0; !equal(tok, "}"); ++i) {
+        if (i > 0) {
+            tok = skip(tok, ",");
+            if (equal(tok, "}")) {
+                break;
+            }
+        }
+        if (i == ty->array_length) {
+            error_tok(tok, "too many initializers.");
+        }
+        initializer(&tok, tok, ty->base, buf + i * ty->base->size);
+    }
+    *rest = skip(tok, "}");
+}
+
+// global-declaration = "const"? typespec
+//                      (global-var ("," global-var)*)? ";"
+// global-var = declarator ("=" initializer)?
+//
+// Returns the variables as a list of top-level definitions.
+static Function *global_declaration(Token **rest, Token *tok) {
+    bool is_const = consume(&tok, tok, "const");
+    Type *basety = typespec(&tok, tok);
+
+    Function head;
+    head.next = NULL;
+    Function *tail = &head;
+    while (!equal(tok, ";")) {
+        if (tail != &head) {
+            tok = skip(tok, ",");
+        }
+        Type *ty = declarator(&tok, tok, basety);
+        Var *var = create_new_global_var(ty);
+        var->is_const = is_const;
+        if (consume(&tok, tok, "=")) {
+            var->init_data = arena_calloc(1, ty->size);
+            initializer(&tok, tok, ty, var->init_data);
+        }
+
+        tail = tail->next = arena_calloc(1, sizeof(Function));
+        tail->name = var->name;
+        tail->var = var;
+    }
+    *rest = skip(tok, ";");
+    return head.next;
+}
+
+// Returns true if the top-level definition at |tok| is a function rather
+// than global variables.
+static bool is_function(Token *tok) {
+    if (equal(tok, "const")) {
+        return false;
+    }
+    tok = tok->next;
+    while (equal(tok, "*")) {
+        tok = tok->next;
+    }
+    return tok->kind != TOKEN_EOF && equal(tok->next, "(");
+}
+
+// toplevel = funcdef | global-declaration
+//
+// Returns the definitions, which are a function or any number of global
+// variables.
+static Function *toplevel(Token **rest, Token *tok) {
+    if (is_function(tok)) {
+        return funcdef(rest, tok);
+    }
+    return global_declaration(rest, tok);
+}
+
+// Parses a loop body, in which case, default and break are errors.
+static Node *loop_body(Token **rest, Token *tok) {
+    Node *sw = current_switch;
+    current_switch = NULL;
+    Node *node = statement(rest, tok);
+    current_switch = sw;
+    return node;
+}
+
+static int compare_cases(const void *a, const void *b) {
+    int x = (*(Node **)a)->val;
+    int y = (*(Node **)b)->val;
+    return (x > y) - (x < y);
+}
+
+// Sorts the case labels of the switch |node| into its |cases| array.
+static void sort_cases(Node *node) {
+    node->cases = arena_calloc(node->ncases, sizeof(Node *));
+    int i = node->ncases;
+    for (Node *c = node->case_next; c; c = c->case_next) {
+        node->cases[--i] = c;
+    }
+    qsort(node->cases, node->ncases, sizeof(Node *), compare_cases);
+    for (i = 1; i < node->ncases; ++i) {
+        if (node->cases[i - 1]->val == node->cases[i]->val) {
+            Node *dup = node->cases[i - 1]->case_id > node->cases[i]->case_id
+                ? node->cases[i - 1] : node->cases[i];
+            error_tok(dup->tok, "duplicate case value.");
+        }
+    }
+}
+
 // statement = "return" expr ";"
 //           | "if" "(" expr ")" statement ("else" statement)?
 //           | "for" "(" expr? ";" expr? ";" expr? ")" statement
 //           | "while" "(" expr ")" statement
+//           | "switch" "(" expr ")" statement
+//           | "case" "-"? num ":" statement
+//           | "default" ":" statement
+//           | "break" ";"
 //           | "{" multi_statement "}"
 //           | expr ";"
 static Node *statement(Token **rest, Token *tok) {
@@ -264,7 +592,7 @@ static Node *statement(Token **rest, Token *tok) {
         }
         tok = skip(tok, ")");
 
-        node->then = statement(&tok, tok);
+        node->then = loop_body(&tok, tok);
         *rest = tok;
         return node;
     }
@@ -274,10 +602,66 @@ static Node *statement(Token **rest, Token *tok) {
         tok = skip(tok->next, "(");
         node->cond = expr(&tok, tok);
         tok = skip(tok, ")");
+        node->then = loop_body(rest, tok);
+        return node;
+    }
+
+    if (equal(tok, "switch")) {
+        Node *node = create_new_node(NODE_SWITCH, tok);
+        tok = skip(tok->next, "(");
+        node->cond = expr(&tok, tok);
+        tok = skip(tok, ")");
+        Node *sw = current_switch;
+        current_switch = node;
         node->then = statement(rest, tok);
+        current_switch = sw;
+        sort_cases(node);
+        return node;
+    }
+
+    if (equal(tok, "case")) {
+        if (!current_switch) {
+            error_tok(tok, "case outside of a switch.");
+        }
+        Node *node = create_new_node(NODE_CASE, tok);
+        tok = tok->next;
+        int sign = 1;
+        if (equal(tok, "-")) {
+            sign = -1;
+            tok = tok->next;
+        }
+        node->val = (int)(sign * (long)take_number(tok));
+        tok = skip(tok->next, ":");
+        node->case_id = current_switch->ncases++;
+        node->case_next = current_switch->case_next;
+        current_switch->case_next = node;
+        node->lhs = statement(rest, tok);
+        return node;
+    }
+
+    if (equal(tok, "default")) {
+        if (!current_switch) {
+            error_tok(tok, "default outside of a switch.");
+        }
+        if (current_switch->default_case) {
+            error_tok(tok, "duplicate default label.");
+        }
+        Node *node = create_new_node(NODE_CASE, tok);
+        tok = skip(tok->next, ":");
+        node->case_id = -1;
+        current_switch->default_case = node;
+        node->lhs = statement(rest, tok);
         return node;
     }
 
+    if (equal(tok, "break")) {
+        if (!current_switch) {
+            error_tok(tok, "break outside of a switch.");
+        }
+        *rest = skip(tok->next, ";");
+        return create_new_node(NODE_BREAK, tok);
+    }
+
     if (equal(tok, "{")) {
         Node *node = multi_statement(&tok, tok->next);
         tok = skip(tok, "}");
@@ -297,7 +681,7 @@ static Node *multi_statement(Token **rest, Token *tok) {
     head.next = NULL;
     Node *tail = &head;
     while (!equal(tok, "}")) {
-        if (equal(tok, "int")) {
+        if (is_typename(tok)) {
             tail = tail->next = declaration(&tok, tok);
         }
         else {
@@ -323,13 +707,95 @@ static Node *expr(Token **rest, Token *tok) {
     return assign(rest, tok);
 }
 
-// assign = equality ("=" assign)?
+// Rejects assignments to a const global variable, or to an element of a
+// const global array.
+static void check_writable(Node *lhs, Token *tok) {
+    Node *node = lhs;
+    while (node->kind == NODE_DEREFERENCE || node->kind == NODE_ADD) {
+        node = node->lhs;
+    }
+    if (node->kind == NODE_VAR && node->var->is_const
+        && (node == lhs || node->var->ty->kind == TY_ARRAY)) {
+        error_tok(tok, "assignment to a const variable.");
+    }
+}
+
+// Creates the compound assignment "|lhs| op= |rhs|", which evaluates the
+// address of |lhs| only once. Like '+' and '-', adding to or subtracting
+// from a pointer scales |rhs| by the size of the pointee.
+static Node *create_new_compound_node(
+    NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
+    add_type(lhs);
+    add_type(rhs);
+    if (!is_integer(rhs->ty)) {
+        error_tok(tok, "invalid operands.");
+    }
+    check_writable(lhs, tok);
+
+    bool is_additive = kind != NODE_MUL_ASSIGN && kind != NODE_DIV_ASSIGN;
+    if (lhs->ty->kind == TY_PTR && is_additive) {
+        int size = lhs->ty->base->size;
+        if (rhs->kind == NODE_NUM) {
+            rhs = create_new_num_node(rhs->val * size, tok);
+        }
+        else {
+            rhs = create_new_binary_node(
+                NODE_MUL, rhs, create_new_num_node(size, tok), tok);
+        }
+    }
+    else if (!is_integer(lhs->ty)) {
+        error_tok(tok, "invalid operands.");
+    }
+    return create_new_binary_node(kind, lhs, rhs, tok);
+}
+
+// assign = logor (("=" | "+=" | "-=" | "*=" | "/=") assign)?
 static Node *assign(Token **rest, Token *tok) {
-    Node *node = equality(&tok, tok);
+    static struct {
+        char *op;
+        NodeKind kind;
+    } compound_ops[] = {
+        { "+=", NODE_ADD_ASSIGN },
+        { "-=", NODE_SUB_ASSIGN },
+        { "*=", NODE_MUL_ASSIGN },
+        { "/=", NODE_DIV_ASSIGN },
+    };
+
+    Node *node = logor(&tok, tok);
     if (equal(tok, "=")) {
+        check_writable(node, tok);
         return create_new_binary_node(
             NODE_ASSIGN, node, assign(rest, tok->next), tok);
     }
+    int nops = sizeof(compound_ops) / sizeof(*compound_ops);
+    for (int i = 0; i < nops; ++i) {
+        if (equal(tok, compound_ops[i].op)) {
+            return create_new_compound_node(compound_ops[i].kind, node,
+                assign(rest, tok->next), tok);
+        }
+    }
+    *rest = tok;
+    return node;
+}
+
+// logor = logand ("||" logand)*
+static Node *logor(Token **rest, Token *tok) {
+    Node *node = logand(&tok, tok);
+    while (equal(tok, "||")) {
+        node = create_new_binary_node(NODE_LOGOR, node, NULL, tok);
+        node->rhs = logand(&tok, tok->next);
+    }
+    *rest = tok;
+    return node;
+}
+
+// logand = equality ("&&" equality)*
+static Node *logand(Token **rest, Token *tok) {
+    Node *node = equality(&tok, tok);
+    while (equal(tok, "&&")) {
+        node = create_new_binary_node(NODE_LOGAND, node, NULL, tok);
+        node->rhs = equality(&tok, tok->next);
+    }
     *rest = tok;
     return node;
 }
@@ -462,7 +928,7 @@ static Node *add(Token **rest, Token *tok) {
     }
 }
 
-// mul = unary ("*" unary | "/" unary)*
+// mul = unary ("*" unary | "/" unary | "%" unary)*
 static Node *mul(Token **rest, Token *tok) {
     Node *node = unary(&tok, tok);
 
@@ -475,6 +941,10 @@ static Node *mul(Token **rest, Token *tok) {
             node = create_new_binary_node(NODE_DIV, node, NULL, tok);
             node->rhs = unary(&tok, tok->next);
         }
+        else if (equal(tok, "%")) {
+            node = create_new_binary_node(NODE_MOD, node, NULL, tok);
+            node->rhs = unary(&tok, tok->next);
+        }
         else {
             *rest = tok;
             return node;
@@ -482,18 +952,43 @@ static Node *mul(Token **rest, Token *tok) {
     }
 }
 
-// unary = ("+" | "-" | "*" | "&") unary
+// unary = ("+" | "-" | "*" | "&" | "!" | "++" | "--") unary
 //       | postfix
 static Node *unary(Token **rest, Token *tok) {
-    if (equal(tok, "+")) {
+    // ++x is x += 1, and --x is x -= 1.
+    if (equal(tok, "++")) {
+        return create_new_compound_node(NODE_ADD_ASSIGN,
+            unary(rest, tok->next), create_new_num_node(1, tok), tok);
+    }
+    else if (equal(tok, "--")) {
+        return create_new_compound_node(NODE_SUB_ASSIGN,
+            unary(rest, tok->next), create_new_num_node(1, tok), tok);
+    }
+    else if (equal(tok, "+")) {
         return unary(rest, tok->next);
     }
+    else if (equal(tok, "!")) {
+        return create_new_unary_node(NODE_NOT, unary(rest, tok->next), tok);
+    }
     else if (equal(tok, "-")) {
+        Node *operand = unary(rest, tok->next);
+        // Fold negative literals so that e.g. "x / -8" keeps a constant
+        // divisor which codegen can strength-reduce.
+        if (operand->kind == NODE_NUM) {
+            operand->val = -operand->val;
+            return operand;
+        }
         return create_new_binary_node(
-            NODE_SUB, create_new_num_node(0, tok), unary(rest, tok->next), tok);
+            NODE_SUB, create_new_num_node(0, tok), operand, tok);
     }
     else if (equal(tok, "&")) {
-        return create_new_unary_node(NODE_ADDRESS, unary(rest, tok->next), tok);
+        Node *operand = unary(rest, tok->next);
+        // Globals are shared by all functions, which are parsed on any
+        // thread, so analyses never track them anyway.
+        if (operand->kind == NODE_VAR && !operand->var->is_global) {
+            operand->var->is_address_taken = true;
+        }
+        return create_new_unary_node(NODE_ADDRESS, operand, tok);
     }
     else if (equal(tok, "*")) {
         return create_new_unary_node(
@@ -513,24 +1008,39 @@ static Node *func_args(Token **rest, Token *tok) {
             tok = skip(tok, ",");
         }
         tail = tail->next = assign(&tok, tok);
+        add_type(tail);
     }
 
     *rest = skip(tok, ")");
     return head.next;
 }
 
-// postfix = primary ("[" expr "]")*
+// postfix = primary ("[" expr "]" | "++" | "--")*
 static Node *postfix(Token **rest, Token *tok) {
     Node *node = primary(&tok, tok);
-    while (equal(tok, "[")) {
+    for (;;) {
         Token *start = tok;
-        Node *idx = expr(&tok, tok->next);
-        tok = skip(tok, "]");
-        node = create_new_unary_node(
-            NODE_DEREFERENCE, create_new_add_node(node, idx, start), start);
+        if (equal(tok, "[")) {
+            Node *idx = expr(&tok, tok->next);
+            tok = skip(tok, "]");
+            node = create_new_unary_node(
+                NODE_DEREFERENCE, create_new_add_node(node, idx, start), start);
+        }
+        else if (equal(tok, "++")) {
+            node = create_new_compound_node(
+                NODE_POST_INC, node, create_new_num_node(1, tok), tok);
+            tok = tok->next;
+        }
+        else if (equal(tok, "--")) {
+            node = create_new_compound_node(
+                NODE_POST_DEC, node, create_new_num_node(1, tok), tok);
+            tok = tok->next;
+        }
+        else {
+            *rest = tok;
+            return node;
+        }
     }
-    *rest = tok;
-    return node;
 }
 
 // primary = "(" expr ")" | num | idnetifier func-args?
@@ -547,6 +1057,10 @@ static Node *primary(Token **rest, Token *tok) {
             Node *node = create_new_node(NODE_FUNCTION_CALL, tok);
             node->funcname = mystrndup(tok->token_string, tok->token_length);
             node->args = func_args(rest, tok->next->next);
+            Var *func = find_function(tok);
+            if (func) {
+                node->ty = func->ty->return_ty;
+            }
             return node;
         }
 
@@ -564,14 +1078,294 @@ static Node *primary(Token **rest, Token *tok) {
 }
 
 
-// program = funcdef*
-Function *parse(Token *tok) {
+// Parsing function bodies in parallel. A function's body depends only on
+// its own tokens, the signatures of the functions defined up to and
+// including it, and the global variables defined before it. So the
+// signatures and global variables are parsed in order first. Then worker
+// threads parse the bodies, each with the |functions| and |globals| lists
+// as they were after its own signature.
+typedef struct ParseJob ParseJob;
+struct ParseJob {
+    Token *tok;        // First token of the body
+    Token *end;        // Token after the body's closing brace
+    Var *func;
+    Var *functions;
+    Var *globals;
+    Function *fn;      // Set up front on a cache hit or a global variable
+    char *cache_key;
+    ErrorTrap trap;
+    bool failed;
+};
+
+typedef struct ParseQueue ParseQueue;
+struct ParseQueue {
+    ParseJob *jobs;
+    int njobs;
+    int next;
+    char *input;
+    pthread_mutex_t lock;
+};
+
+static void *parse_worker(void *arg) {
+    ParseQueue *q = arg;
+    enter_phase(PHASE_PARSE);
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        int i = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        if (i >= q->njobs) {
+            set_error_trap(NULL, q->input);
+            enter_phase(PHASE_NONE);
+            return NULL;
+        }
+        ParseJob *job = &q->jobs[i];
+        if (job->fn) {
+            continue;
+        }
+        if (setjmp(job->trap.env)) {
+            job->failed = true;
+            continue;
+        }
+        set_error_trap(&job->trap, q->input);
+        functions = job->functions;
+        globals = job->globals;
+        Token *rest;
+        job->fn = func_body(&rest, job->tok, job->func);
+        job->fn->cache_key = job->cache_key;
+        if (rest != job->end) {
+            error_tok(rest, "expected the end of the function.");
+        }
+    }
+}
+
+static ParseJob *add_job(ParseQueue *q, int *cap) {
+    if (q->njobs == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        q->jobs = realloc(q->jobs, *cap * sizeof(ParseJob));
+    }
+    return &q->jobs[q->njobs++];
+}
+
+static Function *parse_parallel(Token *tok, int nthreads) {
+    ParseQueue q = {
+        .input = get_current_input(),
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+    };
+    int cap = 0;
+    ErrorTrap signature_trap;
+    bool signature_failed = false;
+    functions = NULL;
+    globals = NULL;
+
+    // Find the functions and parse their signatures, and the global
+    // variables. An error in one means the functions before it may still
+    // have errors to report first.
+    while (tok->kind != TOKEN_EOF) {
+        if (setjmp(signature_trap.env)) {
+            signature_failed = true;
+            break;
+        }
+        set_error_trap(&signature_trap, q.input);
+        if (!is_function(tok)) {
+            Function *vars = global_declaration(&tok, tok);
+            set_error_trap(NULL, q.input);
+            for (Function *var = vars; var; var = var->next) {
+                *add_job(&q, &cap) = (ParseJob) { .fn = var };
+            }
+            continue;
+        }
+        Token *end = skip_function(tok);
+        if (!end) {
+            // Unbalanced braces. This function is parsed on its own below.
+            set_error_trap(NULL, q.input);
+            break;
+        }
+        Token *start = tok;
+        Var *func = func_signature(&tok, tok);
+        set_error_trap(NULL, q.input);
+
+        ParseJob *job = add_job(&q, &cap);
+        *job = (ParseJob) {
+            .tok = tok, .end = end, .func = func, .functions = functions,
+            .globals = globals,
+        };
+        job->fn = find_cached_function(start, end, func, &job->cache_key);
+        tok = end;
+    }
+
+    if (nthreads > q.njobs) {
+        nthreads = q.njobs;
+    }
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    for (int i = 0; i < nthreads; ++i) {
+        if (pthread_create(&threads[i], NULL, parse_worker, &q)) {
+            error("cannot create a thread");
+        }
+    }
+    // The workers account for their own time.
+    Phase prev = enter_phase(PHASE_NONE);
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    enter_phase(prev);
+    free(threads);
+
+    // Report the first error in source order.
+    for (int i = 0; i < q.njobs; ++i) {
+        if (q.jobs[i].failed) {
+            report_trapped_error(&q.jobs[i].trap);
+        }
+    }
+    if (signature_failed) {
+        report_trapped_error(&signature_trap);
+    }
+
     Function head;
     head.next = NULL;
     Function *tail = &head;
+    for (int i = 0; i < q.njobs; ++i) {
+        tail = tail->next = q.jobs[i].fn;
+    }
+    free(q.jobs);
 
+    // Parse the function with unbalanced braces, if any, to report its
+    // error.
     while (tok->kind != TOKEN_EOF) {
-        tail = tail->next = funcdef(&tok, tok);
+        tail->next = toplevel(&tok, tok);
+        while (tail->next) {
+            tail = tail->next;
+        }
+    }
+    return head.next;
+}
+
+// program = toplevel*
+//
+// With |nthreads| > 1, function bodies are parsed on that many threads.
+// The result, including which error is reported, is the same.
+Function *parse(Token *tok, int nthreads) {
+    Phase prev = enter_phase(PHASE_PARSE);
+    Function head;
+    head.next = NULL;
+    Function *tail = &head;
+    functions = NULL;
+    globals = NULL;
+
+    if (nthreads > 1) {
+        head.next = parse_parallel(tok, nthreads);
+    }
+    else {
+        while (tok->kind != TOKEN_EOF) {
+            tail->next = toplevel(&tok, tok);
+            while (tail->next) {
+                tail = tail->next;
+            }
+        }
     }
+    enter_phase(prev);
     return head.next;
 }
+
+// Waits for the next function's tokens, which is not parsing time.
+static Token *wait_for_tokens(TokenStream *s) {
+    Phase prev = enter_phase(PHASE_NONE);
+    Token *tok = next_tokens(s);
+    enter_phase(prev);
+    return tok;
+}
+
+// The lexer ends a batch of tokens at every closing brace at the top
+// level, so a brace initializer ends one like a function body does. Fetches
+// a batch for each such brace in the global declaration at |tok|, so that
+// the batch after the declaration's last one is there once it is parsed.
+static void wait_for_initializers(TokenStream *s, Token *tok) {
+    int depth = 0;
+    for (Token *t = tok; t && t->kind != TOKEN_EOF; t = t->next) {
+        if (equal(t, "{")) {
+            ++depth;
+        }
+        else if (equal(t, "}") && --depth == 0) {
+            wait_for_tokens(s);
+        }
+        else if (depth == 0 && equal(t, ";")) {
+            return;
+        }
+    }
+}
+
+// program = toplevel*, with tokens arriving from the lexer thread of |s|.
+//
+// Calls |callback| with each function and global variable as soon as it
+// has been parsed. The next function's tokens are always fetched before
+// the current one is parsed, so that the parser can step past its closing
+// brace.
+//
+// If |free_functions|, a function's body and tokens are freed once
+// |callback| returns, so memory use depends on the largest function rather
+// than on the whole input. Only the signatures and global variables are
+// kept, for calls and for the functions that use them.
+void parse_stream(TokenStream *s, void (*callback)(Function *fn, void *arg),
+    void *arg, bool free_functions) {
+    functions = NULL;
+    globals = NULL;
+
+    // A lexer error anywhere takes precedence over parse errors, as it does
+    // when the whole input is tokenized first.
+    ErrorTrap trap;
+    if (setjmp(trap.env)) {
+        while (next_tokens(s)) {
+        }
+        report_trapped_error(&trap);
+    }
+    set_error_trap(&trap, get_current_input());
+    Phase prev = enter_phase(PHASE_PARSE);
+
+    Token *tok = wait_for_tokens(s);
+    wait_for_tokens(s);
+    while (tok->kind != TOKEN_EOF) {
+        if (!is_function(tok)) {
+            wait_for_initializers(s, tok);
+            Function *vars = global_declaration(&tok, tok);
+            while (vars) {
+                Function *next = vars->next;
+                if (free_functions) {
+                    vars->var->ty->name = NULL;
+                }
+                callback(vars, arg);
+                vars = next;
+            }
+            continue;
+        }
+        Token *start = tok;
+        Var *func = func_signature(&tok, tok);
+        Arena *arena = free_functions ? new_arena() : NULL;
+        use_arena(arena);
+        Token *end = cache_dir ? skip_function(tok) : NULL;
+        char *key;
+        Function *fn = find_cached_function(start, end, func, &key);
+        if (fn) {
+            tok = end;
+        }
+        else {
+            fn = func_body(&tok, tok, func);
+            fn->cache_key = key;
+        }
+        use_arena(NULL);
+        callback(fn, arg);
+
+        if (free_functions) {
+            // The signature outlives the tokens its names point to.
+            func->ty->name = NULL;
+            for (Type *t = func->ty->params; t; t = t->next) {
+                t->name = NULL;
+            }
+            free(fn->cache_key);
+            free(fn->cached_asm);
+            free_arena(arena);
+            release_tokens(s, tok);
+        }
+        wait_for_tokens(s);
+    }
+    enter_phase(prev);
+    set_error_trap(NULL, get_current_input());
+}
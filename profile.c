@@ -0,0 +1,158 @@
+#include "y3c.h"
+
+// Profile-guided optimization.
+//
+// With -fprofile-generate, every function counts how often it is entered
+// and how often each edge of its if statements and loops is taken. The
+// counters are numbered by a walk over the AST, so that compiling the same
+// source again finds the same numbers. At exit, a destructor appends the
+// counters to the profile as lines of "function counter count". Counts
+// from several runs and translation units add up, so delete the profile to
+// start over.
+//
+// With -fprofile-use, code generation reads the counts back to lay out if
+// statements with the hotter path falling through, to move cold paths out
+// of line, and to decide which loops are worth rotating, unrolling and
+// vectorizing. See codegen.c.
+
+#define PROFILE_DEFAULT_PATH "y3c.prof"
+
+typedef struct ProfileEntry ProfileEntry;
+struct ProfileEntry {
+    char *name;
+    long *counts;
+    int ncounts;
+};
+
+struct Profile {
+    ProfileEntry *entries;  // Sorted by name
+    int nentries;
+};
+
+// Returns the profile path in the value of a -fprofile-* option.
+char *profile_path(char *arg) {
+    char *eq = strchr(arg, '=');
+    return eq ? eq + 1 : PROFILE_DEFAULT_PATH;
+}
+
+// Numbers the counters under |node| from |id| on and returns the next
+// free number. An if statement counts its then and else edges, and a loop
+// counts iterations and exits.
+static int number_counters(Node *node, int id) {
+    if (!node) {
+        return id;
+    }
+    if (node->kind == NODE_IF || node->kind == NODE_FOR) {
+        node->counter = id;
+        id += 2;
+    }
+    id = number_counters(node->lhs, id);
+    id = number_counters(node->rhs, id);
+    id = number_counters(node->cond, id);
+    id = number_counters(node->then, id);
+    id = number_counters(node->els, id);
+    id = number_counters(node->init, id);
+    id = number_counters(node->inc, id);
+    for (Node *n = node->body; n; n = n->next) {
+        id = number_counters(n, id);
+    }
+    for (Node *n = node->args; n; n = n->next) {
+        id = number_counters(n, id);
+    }
+    return id;
+}
+
+// Numbers the counters of |fn| and returns how many it has. Counter 0
+// counts calls.
+int assign_counters(Function *fn) {
+    int id = 1;
+    for (Node *n = fn->node; n; n = n->next) {
+        id = number_counters(n, id);
+    }
+    return id;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((ProfileEntry *)a)->name, ((ProfileEntry *)b)->name);
+}
+
+static ProfileEntry *find_entry(Profile *prof, char *name) {
+    ProfileEntry key = { .name = name };
+    return bsearch(&key, prof->entries, prof->nentries, sizeof(ProfileEntry),
+        compare_entries);
+}
+
+typedef struct Record Record;
+struct Record {
+    char *name;
+    int id;
+    long count;
+};
+
+static int compare_records(const void *a, const void *b) {
+    const Record *x = a;
+    const Record *y = b;
+    int c = strcmp(x->name, y->name);
+    return c ? c : x->id - y->id;
+}
+
+// Reads the profile at |path|, adding up the counts of the same counter.
+Profile *load_profile(char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        error("cannot open profile %s", path);
+    }
+    Record *records = NULL;
+    int nrecords = 0;
+    int cap = 0;
+    char name[256];
+    int id;
+    long count;
+    while (fscanf(fp, "%255s %d %ld", name, &id, &count) == 3) {
+        if (id < 0) {
+            error("%s: invalid counter %d in %s", path, id, name);
+        }
+        if (nrecords == cap) {
+            cap = cap ? cap * 2 : 256;
+            records = realloc(records, cap * sizeof(Record));
+        }
+        records[nrecords++] = (Record) { strdup(name), id, count };
+    }
+    if (!feof(fp)) {
+        error("%s: malformed profile", path);
+    }
+    fclose(fp);
+
+    // Group the records by function.
+    qsort(records, nrecords, sizeof(Record), compare_records);
+    Profile *prof = calloc(1, sizeof(Profile));
+    prof->entries = calloc(nrecords, sizeof(ProfileEntry));
+    for (int i = 0; i < nrecords;) {
+        int j = i;
+        while (j < nrecords && !strcmp(records[j].name, records[i].name)) {
+            ++j;
+        }
+        ProfileEntry *e = &prof->entries[prof->nentries++];
+        e->name = records[i].name;
+        e->ncounts = records[j - 1].id + 1;
+        e->counts = calloc(e->ncounts, sizeof(long));
+        for (; i < j; ++i) {
+            e->counts[records[i].id] += records[i].count;
+            if (records[i].name != e->name) {
+                free(records[i].name);
+            }
+        }
+    }
+    free(records);
+    return prof;
+}
+
+// Returns the counts of |fn| in |prof|, or NULL if there are none or they
+// are from a different version of |fn|.
+long *find_profile(Profile *prof, Function *fn, int ncounters) {
+    ProfileEntry *e = find_entry(prof, fn->name);
+    if (!e || e->ncounts != ncounters) {
+        return NULL;
+    }
+    return e->counts;
+}
@@ -0,0 +1,362 @@
+#include "y3c.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Compile server.
+//
+// y3c --server=PATH listens on a Unix domain socket at PATH, and
+// y3c --client=PATH <args> has it compile a program as y3c <args> would.
+// Requests skip process startup, and the compilation cache and the
+// workers' arenas stay warm between them. A pool of worker threads serves
+// connections concurrently. y3c --client=PATH --stats prints the latency
+// percentiles of the requests served so far.
+//
+// A request is the number of arguments followed by the arguments, with
+// source files already replaced by their contents and -o left out. The
+// response is the exit status, the output (assembly, or an object file with
+// -c) and the error messages. Numbers are native 32-bit integers, and
+// strings are a length followed by that many bytes.
+
+static bool write_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool send_string(int fd, char *s, size_t len) {
+    uint32_t n = len;
+    return write_all(fd, &n, sizeof(n)) && write_all(fd, s, len);
+}
+
+// Returns a NUL-terminated copy of the next string and its length, or NULL.
+static char *recv_string(int fd, size_t *len) {
+    uint32_t n;
+    if (!read_all(fd, &n, sizeof(n))) {
+        return NULL;
+    }
+    char *s = malloc(n + 1);
+    if (!read_all(fd, s, n)) {
+        free(s);
+        return NULL;
+    }
+    s[n] = '\0';
+    *len = n;
+    return s;
+}
+
+//
+// Server
+//
+
+typedef struct Response Response;
+struct Response {
+    uint32_t status;
+    char *out;
+    size_t outlen;
+    char *err;
+    size_t errlen;
+};
+
+static int listen_fd;
+
+// Request latencies in microseconds, for --stats.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static long *latencies;
+static int nlatencies;
+static int latencies_cap;
+
+// Each worker compiles into its own arena, which is reset after every
+// request rather than freed.
+static _Thread_local Arena *request_arena;
+
+static long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void record_latency(long us) {
+    pthread_mutex_lock(&stats_lock);
+    if (nlatencies == latencies_cap) {
+        latencies_cap = latencies_cap ? latencies_cap * 2 : 1024;
+        latencies = realloc(latencies, latencies_cap * sizeof(long));
+    }
+    latencies[nlatencies++] = us;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static int compare_longs(const void *a, const void *b) {
+    long x = *(long *)a;
+    long y = *(long *)b;
+    return (x > y) - (x < y);
+}
+
+static void format_stats(Response *res) {
+    pthread_mutex_lock(&stats_lock);
+    int n = nlatencies;
+    long *sorted = malloc((n + 1) * sizeof(long));
+    memcpy(sorted, latencies, n * sizeof(long));
+    pthread_mutex_unlock(&stats_lock);
+    qsort(sorted, n, sizeof(long), compare_longs);
+
+    FILE *out = open_memstream(&res->out, &res->outlen);
+    fprintf(out, "requests: %d\n", n);
+    if (n > 0) {
+        int percentiles[] = { 50, 90, 99 };
+        for (int i = 0; i < 3; ++i) {
+            int idx = (long)(n - 1) * percentiles[i] / 100;
+            fprintf(out, "p%d: %ldus\n", percentiles[i], sorted[idx]);
+        }
+        fprintf(out, "max: %ldus\n", sorted[n - 1]);
+    }
+    fclose(out);
+    free(sorted);
+}
+
+// Compiles the program in |args| as main() would.
+static void compile_request(char **args, int nargs, Response *res) {
+    if (!request_arena) {
+        request_arena = new_arena();
+    }
+
+    ErrorTrap trap;
+    if (setjmp(trap.env)) {
+        use_arena(NULL);
+        set_error_trap(NULL, "");
+        reset_arena(request_arena);
+        res->status = 1;
+        res->err = trap.msg;
+        res->errlen = strlen(trap.msg);
+        return;
+    }
+    set_error_trap(&trap, "");
+
+    reset_codegen_options();
+    char *input = NULL;
+    bool emit_object = false;
+    for (int i = 0; i < nargs; ++i) {
+        if (!strcmp(args[i], "-c")) {
+            emit_object = true;
+        }
+        else if (parse_codegen_option(args[i])) {
+        }
+        else if (args[i][0] == '-' && args[i][1]) {
+            error("y3c: unknown option for the server: %s", args[i]);
+        }
+        else if (input) {
+            error("y3c: invalid number of arguments.");
+        }
+        else {
+            input = args[i];
+        }
+    }
+    if (!input) {
+        error("y3c: invalid number of arguments.");
+    }
+    check_codegen_options("y3c", emit_object, false, false);
+
+    use_arena(request_arena);
+    Function *prog = parse(tokenize(input), 1);
+    for (Function *fn = prog; fn; fn = fn->next) {
+        layout_frame(fn);
+    }
+    char *buf;
+    size_t buflen;
+    FILE *out = open_memstream(&buf, &buflen);
+    codegen(prog, out, 1);
+    fclose(out);
+    for (Function *fn = prog; fn; fn = fn->next) {
+        free(fn->cache_key);
+        free(fn->cached_asm);
+    }
+    use_arena(NULL);
+    reset_arena(request_arena);
+
+    if (emit_object) {
+        FILE *obj = open_memstream(&res->out, &res->outlen);
+        assemble_to(buf, obj);
+        fclose(obj);
+        free(buf);
+    }
+    else {
+        res->out = buf;
+        res->outlen = buflen;
+    }
+    set_error_trap(NULL, "");
+}
+
+static void serve(int fd) {
+    uint32_t nargs;
+    if (!read_all(fd, &nargs, sizeof(nargs)) || nargs > 4096) {
+        return;
+    }
+    char **args = calloc(nargs, sizeof(char *));
+    size_t len;
+    for (uint32_t i = 0; i < nargs; ++i) {
+        if (!(args[i] = recv_string(fd, &len))) {
+            nargs = i;
+            goto out;
+        }
+    }
+
+    long start = now_us();
+    Response res = {0};
+    if (nargs == 1 && !strcmp(args[0], "--stats")) {
+        format_stats(&res);
+    }
+    else {
+        compile_request(args, nargs, &res);
+    }
+    write_all(fd, &res.status, sizeof(res.status));
+    send_string(fd, res.out, res.outlen);
+    send_string(fd, res.err, res.errlen);
+    free(res.out);
+    free(res.err);
+    if (!(nargs == 1 && !strcmp(args[0], "--stats"))) {
+        record_latency(now_us() - start);
+    }
+
+out:
+    for (uint32_t i = 0; i < nargs; ++i) {
+        free(args[i]);
+    }
+    free(args);
+}
+
+static void *server_worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd >= 0) {
+            serve(fd);
+            close(fd);
+        }
+        else if (errno != EINTR && errno != ECONNABORTED) {
+            error("y3c: accept: %s", strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+// Serves requests on |path| with |nthreads| workers. Never returns.
+void run_server(char *path, int nthreads) {
+    // A client that goes away must not take the server with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        error("y3c: socket path too long: %s", path);
+    }
+    strcpy(addr.sun_path, path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr,
+        sizeof(addr)) || listen(listen_fd, 128)) {
+        error("y3c: cannot listen on %s: %s", path, strerror(errno));
+    }
+
+    for (int i = 1; i < nthreads; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, server_worker, NULL)) {
+            error("cannot create a thread");
+        }
+    }
+    server_worker(NULL);
+}
+
+//
+// Client
+//
+
+// Has the server at |path| compile the program in |args| and writes the
+// result where y3c itself would. Returns the exit status.
+int run_client(char *path, char **args, int nargs) {
+    char *output_path = NULL;
+    bool emit_object = false;
+    char **fwd = calloc(nargs, sizeof(char *));
+    int nfwd = 0;
+    for (int i = 0; i < nargs; ++i) {
+        if (!strcmp(args[i], "-o")) {
+            if (++i == nargs) {
+                error("y3c: missing filename after '-o'");
+            }
+            output_path = args[i];
+            continue;
+        }
+        if (!strcmp(args[i], "-c")) {
+            emit_object = true;
+        }
+        fwd[nfwd++] = is_source_file(args[i]) ? read_file(args[i]) : args[i];
+    }
+    if (emit_object && !output_path) {
+        error("y3c: -c requires -o <file>");
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        error("y3c: socket path too long: %s", path);
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        error("y3c: cannot connect to %s: %s", path, strerror(errno));
+    }
+
+    uint32_t n = nfwd;
+    bool ok = write_all(fd, &n, sizeof(n));
+    for (int i = 0; ok && i < nfwd; ++i) {
+        ok = send_string(fd, fwd[i], strlen(fwd[i]));
+    }
+    uint32_t status;
+    size_t outlen;
+    size_t errlen;
+    char *out = NULL;
+    char *err = NULL;
+    ok = ok && read_all(fd, &status, sizeof(status))
+        && (out = recv_string(fd, &outlen))
+        && (err = recv_string(fd, &errlen));
+    close(fd);
+    if (!ok) {
+        error("y3c: lost connection to %s", path);
+    }
+
+    fwrite(err, 1, errlen, stderr);
+    if (status == 0) {
+        FILE *fp = stdout;
+        if (output_path) {
+            fp = fopen(output_path, "wb");
+            if (!fp) {
+                error("y3c: cannot open %s", output_path);
+            }
+        }
+        fwrite(out, 1, outlen, fp);
+        fclose(fp);
+    }
+    return status;
+}
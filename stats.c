@@ -0,0 +1,231 @@
+#include "y3c.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Compiler self-profiling.
+//
+// With --stats, y3c reports where it spent its time and memory as JSON on
+// stderr. Each thread charges the time between two enter_phase() calls to
+// the phase it was in, so phases may nest, like add_type() within parse,
+// and their times do not overlap. Phase times are summed over all threads,
+// so with -jN they may add up to more than the wall time of the whole run.
+// Allocations are the ones made with arena_calloc(): tokens, nodes,
+// variables and types.
+
+bool opt_stats;
+
+static char *phase_names[] = {
+    [PHASE_TOKENIZE] = "tokenize",
+    [PHASE_PARSE] = "parse",
+    [PHASE_ADD_TYPE] = "add_type",
+    [PHASE_LAYOUT] = "layout",
+    [PHASE_CODEGEN] = "codegen",
+};
+
+static char *node_names[] = {
+    [NODE_ADD] = "NODE_ADD",
+    [NODE_SUB] = "NODE_SUB",
+    [NODE_MUL] = "NODE_MUL",
+    [NODE_DIV] = "NODE_DIV",
+    [NODE_MOD] = "NODE_MOD",
+    [NODE_EQ] = "NODE_EQ",
+    [NODE_NE] = "NODE_NE",
+    [NODE_LT] = "NODE_LT",
+    [NODE_LE] = "NODE_LE",
+    [NODE_GT] = "NODE_GT",
+    [NODE_GE] = "NODE_GE",
+    [NODE_LOGAND] = "NODE_LOGAND",
+    [NODE_LOGOR] = "NODE_LOGOR",
+    [NODE_NOT] = "NODE_NOT",
+    [NODE_ASSIGN] = "NODE_ASSIGN",
+    [NODE_ADD_ASSIGN] = "NODE_ADD_ASSIGN",
+    [NODE_SUB_ASSIGN] = "NODE_SUB_ASSIGN",
+    [NODE_MUL_ASSIGN] = "NODE_MUL_ASSIGN",
+    [NODE_DIV_ASSIGN] = "NODE_DIV_ASSIGN",
+    [NODE_POST_INC] = "NODE_POST_INC",
+    [NODE_POST_DEC] = "NODE_POST_DEC",
+    [NODE_ADDRESS] = "NODE_ADDRESS",
+    [NODE_DEREFERENCE] = "NODE_DEREFERENCE",
+    [NODE_RETURN] = "NODE_RETURN",
+    [NODE_IF] = "NODE_IF",
+    [NODE_FOR] = "NODE_FOR",
+    [NODE_BLOCK] = "NODE_BLOCK",
+    [NODE_SWITCH] = "NODE_SWITCH",
+    [NODE_CASE] = "NODE_CASE",
+    [NODE_BREAK] = "NODE_BREAK",
+    [NODE_FUNCTION_CALL] = "NODE_FUNCTION_CALL",
+    [NODE_EXPR_STATEMENT] = "NODE_EXPR_STATEMENT",
+    [NODE_VAR] = "NODE_VAR",
+    [NODE_NUM] = "NODE_NUM",
+};
+
+#define NNODE_KINDS (int)(sizeof(node_names) / sizeof(*node_names))
+
+typedef struct PhaseStats PhaseStats;
+struct PhaseStats {
+    atomic_long wall_ns;
+    atomic_long cpu_ns;
+    atomic_long allocations;
+    atomic_long allocated_bytes;
+};
+
+static PhaseStats phases[NPHASES];
+static atomic_long ntokens;
+static atomic_long nnodes[NNODE_KINDS];
+static long start_ns;
+
+// The phase this thread is in, and when it entered it.
+static _Thread_local Phase current_phase;
+static _Thread_local long phase_wall_ns;
+static _Thread_local long phase_cpu_ns;
+
+typedef struct FunctionStats FunctionStats;
+struct FunctionStats {
+    char *name;
+    long instructions;
+};
+
+static pthread_mutex_t functions_lock = PTHREAD_MUTEX_INITIALIZER;
+static FunctionStats *functions;
+static int nfunctions;
+static int functions_cap;
+
+static long clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void start_stats(void) {
+    opt_stats = true;
+    start_ns = clock_ns(CLOCK_MONOTONIC);
+}
+
+// Switches this thread to |phase| and returns the phase it was in, which
+// the caller restores when it is done.
+Phase enter_phase(Phase phase) {
+    if (!opt_stats) {
+        return PHASE_NONE;
+    }
+    Phase prev = current_phase;
+    long wall = clock_ns(CLOCK_MONOTONIC);
+    long cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    if (prev != PHASE_NONE) {
+        phases[prev].wall_ns += wall - phase_wall_ns;
+        phases[prev].cpu_ns += cpu - phase_cpu_ns;
+    }
+    current_phase = phase;
+    phase_wall_ns = wall;
+    phase_cpu_ns = cpu;
+    return prev;
+}
+
+void count_allocation(size_t size) {
+    if (opt_stats) {
+        ++phases[current_phase].allocations;
+        phases[current_phase].allocated_bytes += size;
+    }
+}
+
+void count_token(void) {
+    if (opt_stats) {
+        ++ntokens;
+    }
+}
+
+void count_node(NodeKind kind) {
+    if (opt_stats) {
+        ++nnodes[kind];
+    }
+}
+
+// Returns the number of instructions in |text|, which are the indented
+// lines other than directives.
+long count_instructions(char *text) {
+    long n = 0;
+    for (char *p = text; *p; ++p) {
+        if (*p == ' ' && p[1] && p[2] != '.'
+            && (p == text || p[-1] == '\n')) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+void record_function_stats(char *name, long instructions) {
+    if (!opt_stats) {
+        return;
+    }
+    pthread_mutex_lock(&functions_lock);
+    if (nfunctions == functions_cap) {
+        functions_cap = functions_cap ? functions_cap * 2 : 64;
+        functions = realloc(functions, functions_cap * sizeof(FunctionStats));
+    }
+    functions[nfunctions++] = (FunctionStats) { strdup(name), instructions };
+    pthread_mutex_unlock(&functions_lock);
+}
+
+// Functions are generated in any order with -jN, so sort them by name.
+static int compare_functions(const void *a, const void *b) {
+    return strcmp(((FunctionStats *)a)->name, ((FunctionStats *)b)->name);
+}
+
+static double seconds(long ns) {
+    return ns / 1e9;
+}
+
+static double timeval_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void print_stats(FILE *out) {
+    // Close the slice of whatever phase this thread is in.
+    enter_phase(enter_phase(PHASE_NONE));
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(out, "{\n");
+    fprintf(out, "  \"wall_seconds\": %.6f,\n",
+        seconds(clock_ns(CLOCK_MONOTONIC) - start_ns));
+    fprintf(out, "  \"cpu_seconds\": %.6f,\n",
+        timeval_seconds(ru.ru_utime) + timeval_seconds(ru.ru_stime));
+    fprintf(out, "  \"max_rss_kb\": %ld,\n", ru.ru_maxrss);
+
+    fprintf(out, "  \"phases\": {\n");
+    for (int i = PHASE_NONE + 1; i < NPHASES; ++i) {
+        PhaseStats *p = &phases[i];
+        fprintf(out, "    \"%s\": {\"wall_seconds\": %.6f, "
+            "\"cpu_seconds\": %.6f, \"allocations\": %ld, "
+            "\"allocated_bytes\": %ld}%s\n",
+            phase_names[i], seconds(p->wall_ns), seconds(p->cpu_ns),
+            (long)p->allocations, (long)p->allocated_bytes,
+            i + 1 < NPHASES ? "," : "");
+    }
+    fprintf(out, "  },\n");
+
+    fprintf(out, "  \"tokens\": %ld,\n", (long)ntokens);
+    long total = 0;
+    for (int i = 0; i < NNODE_KINDS; ++i) {
+        total += nnodes[i];
+    }
+    fprintf(out, "  \"nodes\": {\n");
+    fprintf(out, "    \"total\": %ld", total);
+    for (int i = 0; i < NNODE_KINDS; ++i) {
+        if (nnodes[i]) {
+            fprintf(out, ",\n    \"%s\": %ld", node_names[i], (long)nnodes[i]);
+        }
+    }
+    fprintf(out, "\n  },\n");
+
+    qsort(functions, nfunctions, sizeof(FunctionStats), compare_functions);
+    fprintf(out, "  \"functions\": [");
+    for (int i = 0; i < nfunctions; ++i) {
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"instructions\": %ld}",
+            i ? "," : "", functions[i].name, functions[i].instructions);
+    }
+    fprintf(out, "%s]\n", nfunctions ? "\n  " : "");
+    fprintf(out, "}\n");
+}
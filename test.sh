@@ -1,7 +1,16 @@
 #!/bin/bash
+# With --manifest FILE, the cases are written to FILE for "y3c --batch"
+# instead of being compiled and run one by one. See "make fasttest".
+manifest=
+if [ "$1" = "--manifest" ]; then
+  manifest="$2"
+  : > "$manifest"
+fi
+
 cat <<EOF | gcc -xc -c -o tmp2.o -
 int ret3() { return 3; }
 int ret5() { return 5; }
+int retm1() { return -1; }
 int add(int x, int y) { return x + y; }
 int sub(int x, int y) { return x - y; }
 int add6(int a, int b, int c, int d, int e, int f){
@@ -12,11 +21,25 @@ EOF
 assert(){
   expected="$1"
   input="$2"
-  ./y3c "$input" > tmp.s || exit
+  if [ -n "$manifest" ]; then
+    printf '%s\t%s\t%s\n' "$expected" "${*:3}" "$input" >> "$manifest"
+    return
+  fi
+  ./y3c "${@:3}" "$input" > tmp.s || exit
   cc -static -o tmp tmp.s tmp2.o
   ./tmp
   actual="$?"
 
+  # The built-in assembler must produce a program that behaves the same.
+  ./y3c "${@:3}" -c -o tmp3.o "$input" || exit
+  cc -static -o tmp tmp3.o tmp2.o
+  ./tmp
+  actual_obj="$?"
+  if [ "$actual_obj" != "$actual" ]; then
+    echo "$input => $actual with cc, but got $actual_obj with -c"
+    exit 1
+  fi
+
   if [ "$actual" = "$expected" ]; then
     echo "$input => $actual"
   else
@@ -25,6 +48,24 @@ assert(){
   fi
 }
 
+# Runs the program in-process with --run instead of assembling and linking.
+assert_run(){
+  expected="$1"
+  input="$2"
+  if [ -n "$manifest" ]; then
+    return
+  fi
+  ./y3c --run "${@:3}" "$input" > /dev/null
+  actual="$?"
+
+  if [ "$actual" = "$expected" ]; then
+    echo "--run $input => $actual"
+  else
+    echo "--run $input => $expected expected, but got $actual"
+    exit 1
+  fi
+}
+
 assert 0  'int main() { return 0; }'
 assert 42 'int main() { return 42; }'
 assert 21 'int main() { return 5+20-4; }'
@@ -39,6 +80,10 @@ assert 10 'int main() { return 60/2/3; }'
 assert 47 'int main() { return 5+6*7; }'
 assert 15 'int main() { return 5*(9-6); }'
 assert 4  'int main() { return (3+5)/2; }'
+assert 2  'int main() { return 17%5; }'
+assert 2  'int main() { int x=-17; return x/-8%3; }'
+assert 0  'int main() { int x=5; return x*0; }'
+assert 45 'int main() { int x=5; return x*9; }'
 
 assert 10 'int main() { return -10+20; }'
 assert 10 'int main() { return - -10; }'
@@ -151,4 +196,334 @@ assert 3 'int main() { int x[2][3]; int *y=x; y[3]=3; return x[1][0]; }'
 assert 4 'int main() { int x[2][3]; int *y=x; y[4]=4; return x[1][1]; }'
 assert 5 'int main() { int x[2][3]; int *y=x; y[5]=5; return x[1][2]; }'
 
+assert 1  'int main() { char x; x=257; return x; }'
+assert 1  'int main() { char x=-1; return x<0; }'
+assert 3  'int main() { short x=65539; return x; }'
+assert 1  'int main() { int x=2147483647; x=x+1; return x<0; }'
+assert 0  'int main() { long x=2147483647; x=x+1; return x<0; }'
+assert 2  'int main() { short x[3]; char *a=x; char *b=x+1; return b-a; }'
+assert 4  'int main() { int x[3]; char *a=x; char *b=x+1; return b-a; }'
+assert 8  'int main() { long x[3]; char *a=x; char *b=x+1; return b-a; }'
+assert 6  'int main() { char x[3]; x[0]=1; x[1]=2; x[2]=3; return x[0]+x[1]+x[2]; }'
+assert 6  'int main() { char c=1; long l=2; char d=3; return c+l+d; }'
+assert 7  'int main() { return f(1, 2, 4); } int f(char a, short b, long c) { return a+b+c; }'
+assert 1  'char g() { return 200; } int main() { return g()<0; }'
+assert 1  'int main() { return retm1()==-1; }'
+
+assert 30 'int main() { int s=0; { int a[10]; int i; for (i=0; i<10; i=i+1) a[i]=i; s=s+a[9]; } { long b[20]; int j; for (j=0; j<20; j=j+1) b[j]=2*j; s=s+b[10]; } return s+1; }'
+assert 15 'int main() { int x=5; int y=x*2; int z=y+x; int w=z; return w; }'
+assert 9  'int main() { int i; int t; int s=0; for (i=0; i<3; i=i+1) { t=i; s=s+t+2; } int u=s; return u; }'
+assert 7  'int main() { int a[2]; int *p=a; int b[2]; b[0]=3; b[1]=4; *p=b[0]; p[1]=b[1]; return a[0]+a[1]; }'
+assert 14 'int main() { int x[2]; int *p; int y; x[0]=5; p=&x[0]; y=9; return *p+y; }'
+assert 15 'int main() { int x[2]; int *p; x[1]=6; p=&x[1]; long y; y=9; return *p+y; }'
+
+# Vectorizable loops, including remainders, reductions and overlapping
+# pointers which must fall back to the scalar loop.
+for flags in -fno-unroll-loops '-fno-unroll-loops -mavx2'; do
+  assert 82 'int main() { int a[7]; int b[7]; int c[7]; int i; for (i=0; i<7; i=i+1) { a[i]=i; b[i]=i*i; } for (i=0; i<7; i=i+1) c[i]=a[i]+b[i]; return c[6]+c[5]+i+3; }' $flags
+  assert 12 'int main() { int a[9]; int b[9]; int i; for (i=0; i<9; i=i+1) { a[i]=i*3; b[i]=i; } int n=9; for (i=0; i<n; i=i+1) a[i]=a[i]-b[i]; return a[4]+a[2]; }' $flags
+  assert 45 'int main() { int a[10]; int i; int s=0; for (i=0; i<10; i=i+1) a[i]=i; for (i=0; i<10; i=i+1) s=s+a[i]; return s; }' $flags
+  assert 24 'int main() { int a[5]; int *p=a; int i; int s=4; for (i=0; i<5; i=i+1) a[i]=i+1; for (i=0; i<5; i=i+1) s=p[i]+s; return s+i; }' $flags
+  assert 6  'int main() { int a[8]; int *p=a; int *q=a+1; int i; for (i=0; i<8; i=i+1) a[i]=1; for (i=0; i<7; i=i+1) q[i]=p[i]+q[i]; return a[5]; }' $flags
+  assert 2  'int main() { int a[8]; int *p=a+1; int *q=a; int i; for (i=0; i<8; i=i+1) a[i]=1; for (i=0; i<7; i=i+1) q[i]=p[i]+q[i]; return a[5]; }' $flags
+  for t in char short int long; do
+    assert 6 "int main() { $t a[37]; $t b[37]; $t c[37]; $t s=0; int i; int n=37; for (i=0; i<n; i=i+1) { a[i]=i; b[i]=2*i; } for (i=0; i<n; i=i+1) c[i]=a[i]+b[i]; for (i=0; i<n; i=i+1) s=s+a[i]; return c[36]+s; }" $flags
+  done
+  assert 224 'int main() { char a[64]; char s=0; int i; for (i=0; i<64; i=i+1) a[i]=100+i; for (i=0; i<64; i=i+1) s=s+a[i]; return s; }' $flags
+done
+
+# Unrolled loops: constant trip counts, remainders, early exits, bodies
+# that change the induction variable themselves and bounds near LONG_MAX.
+for flags in '' -funroll-factor=3 -fno-unroll-loops; do
+  assert 28 'int main() { int i; int s=0; for (i=0; i<8; i=i+1) s=s+i; return s; }' $flags
+  assert 36 'int main() { int i; int s=0; for (i=1; i<=8; i=i+1) s=s+i; return s; }' $flags
+  assert 26 'int main() { int i; int s=0; for (i=2; i<11; i=i+3) s=s+i; return s+i; }' $flags
+  assert 0  'int main() { int i; int s=0; for (i=5; i<5; i=i+1) s=s+1; return s; }' $flags
+  assert 70 'int main() { int i; int n=11; int s=0; for (i=0; i<n; i=i+1) s=s+i+1; return s+i-7; }' $flags
+  assert 13 'int main() { int i; int n=100; for (i=0; i<n; i=i+1) if (i==13) return i; return 0; }' $flags
+  assert 12 'int main() { int i; int n=20; int s=0; for (i=0; i<n; i=i+1) { s=s+1; i=i+1; } return s+i-20+2; }' $flags
+  assert 30 'int main() { int i; int j; int s=0; for (i=0; i<5; i=i+1) for (j=0; j<6; j=j+1) s=s+1; return s; }' $flags
+  assert 8  'int main() { long m=(-2147483647-1)*65536*65536; long n=-(m+1); long i; int c=0; for (i=n-2; i<n; i++) c++; for (i=n-3; i<=n-1; i++) c+=2; for (i=n; i<m+5; i++) c+=10; return c; }' $flags
+  assert 3  'int main() { long n=1500000000; n=n*2+1; long i; int c=0; for (i=0; i<n; i+=1500000000) c++; return c; }' $flags
+done
+
+# Switch statements: jump tables for dense cases, binary search for sparse
+# ones, fallthrough, nesting and a switch in a loop that gets unrolled.
+assert 34 'int f(int x) { switch (x) { case 1: return 10; case 2: return 20; case 3: case 4: return 34; case 6: return 60; default: return 99; } return 0; } int main() { return f(4); }'
+assert 99 'int f(int x) { switch (x) { case 1: return 10; case 2: return 20; case 3: case 4: return 34; case 6: return 60; default: return 99; } return 0; } int main() { return f(5); }'
+assert 3  'int main() { int r=0; switch (7) { case 1: r=1; break; case 5: r=2; break; } return r+3; }'
+assert 5  'int main() { int r=0; switch (5) { case 5: r=r+2; case 6: r=r+3; break; case 7: r=r+4; } return r; }'
+assert 7  'int main() { int r=0; switch (-100) { case 100000: r=1; break; case -100: r=7; break; case 12: r=2; break; case 13: r=3; break; case 14: r=4; break; case 15: r=5; break; case 999: r=6; break; } return r; }'
+assert 4  'int main() { int r=0; switch (14) { case 100000: r=1; break; case -100: r=7; break; case 12: r=2; break; case 13: r=3; break; case 14: r=4; break; case 15: r=5; break; case 999: r=6; break; } return r; }'
+assert 0  'int main() { int r=0; switch (16) { case 100000: r=1; break; case -100: r=7; break; case 12: r=2; break; case 13: r=3; break; case 14: r=4; break; case 15: r=5; break; case 999: r=6; break; } return r; }'
+assert 21 'int main() { int r=0; long x=2; switch (x) { case 2: switch (x+1) { case 3: r=20; break; default: r=30; } r=r+1; break; default: r=40; } return r; }'
+assert 51 'int main() { int i; int s=0; for (i=0; i<10; i=i+1) { switch (i%4) { case 0: s=s+1; break; case 1: s=s+3; case 2: s=s+5; break; default: s=s+7; } } return s; }'
+
+# Logical operators short-circuit, as values and as conditions.
+assert 1  'int main() { return 2 && 3; }'
+assert 0  'int main() { return 2 && 0; }'
+assert 1  'int main() { return 0 || -1; }'
+assert 0  'int main() { return 0 || 0; }'
+assert 1  'int main() { return !0; }'
+assert 0  'int main() { return !7; }'
+assert 3  'int main() { int x=0; int y=0; if (x && (y=1)) return 9; if (!x || (y=2)) return y+3; return 7; }'
+assert 1  'int main() { int x=5; return x>3 && x<10 && !(x==4) || (x=0); }'
+assert 12 'int main() { int i; int s=0; for (i=0; i<10 && s<10; i=i+1) s=s+i; return s+!(s<3)+!!i; }'
+assert 5  'int main() { int i; int n=0; for (i=0; i<20; i=i+1) if (i<3 || i>16 && i!=18) n=n+1; return n; }'
+assert 2  'int main() { int a[3]; int i=3; while (i>0 && (a[i-1]=i)) i=i-1; return a[1]; }'
+
+# Compound assignments and increments evaluate their lvalue once.
+assert 7  'int main() { int x=4; x+=3; return x; }'
+assert 9  'int main() { int x=4; int y=(x-=1); y+=(x*=2); return y+x-6; }'
+assert 3  'int main() { int x=-13; x/=4; return -x; }'
+assert 6  'int main() { int x=5; int y=x++; return x+y+(x--)-11; }'
+assert 13 'int main() { int x=5; int y=++x; return x+y+(--x)-4; }'
+assert 0  'int main() { char c=127; c+=1; c++; return c+127; }'
+assert 3  'int main() { int a[3]; int *p=a; a[0]=1; a[1]=2; a[2]=3; p+=2; p--; int x=*p++; int d=p-a; return x+d-1; }'
+assert 10 'int main() { int a[2]; int i=0; a[0]=0; a[1]=0; a[i++]+=7; a[i]+=3; return a[0]+a[1]; }'
+assert 45 'int main() { int a[10]; int i; int s=0; for (i=0; i<10; i++) a[i]=i; for (i=0; i<10; ++i) s+=a[i]; return s; }'
+assert 86 'int main() { int a[100]; int i; int n=100; int s=0; for (i=0; i<n; i+=1) a[i]=i; for (i=0; i<n; i++) s+=a[i]; return s%256; }'
+
+assert 5  'int g=5; int main() { return g; }'
+assert 7  'int g; int main() { g=3; g+=4; return g; }'
+assert 7  'int k=2*3+1; long big=-2; int main() { return k+big+2; }'
+assert 41 'const char t[4]={1,2,3,4}; int main() { return t[0]+t[3]*10; }'
+assert 12 'int m[2][3]={{1,2,3},{4,5,6},}; int main() { return m[1][2]*m[0][1]; }'
+assert 3  'int c; int inc() { c++; return c; } int main() { inc(); inc(); return inc(); }'
+assert 10 'int *p; int a[3]={1,2}; int main() { p=&a[1]; *p=9; return a[0]+a[1]+a[2]; }'
+assert 6  'int a[4]; int main() { int i; int s=0; for (i=0; i<4; i++) a[i]=i; for (i=0; i<4; i++) s+=a[i]; return s; }'
+assert 5  'int di; int cl[2]={1,2}; int main() { di=3; di+=cl[1]; return di; }'
+
+assert 86 'int main() { int a[100]; int b[100]; int i; int n=100; int s=0; for (i=0; i<n; i++) a[i]=i; for (i=0; i<n; i++) b[i]=a[i]; for (i=0; i<n; i++) s+=b[i]; return s%256+i-n; }'
+assert 40 'int f(char *p, int n, int v) { int i=3; for (; i<n; ++i) p[i]=v; return i; } int main() { char c[40]; c[2]=0; return f(c, 40, -1)+c[39]+c[3]+c[2]+f(c, 2, 5)-1; }'
+assert 73 'long l[30]; int main() { int i; int n=7; for (i=5; i<30; i++) l[i]=n; for (i=30; i<n; i++) l[i]=0; return l[5]+l[29]+l[4]+i+29; }'
+assert 19 'int main() { int a[10]; int i; for (i=0; i<10; i++) a[i]=i+1; int *p=a; int *q=a+1; int n=9; for (i=0; i<n; i++) q[i]=p[i]; return a[9]*10+i; }'
+
+assert_run 42 'int main() { return 42; }'
+assert_run 109 'int main() { return fib(20)%256; } int fib(int x) { if (x<2) return x; return fib(x-1)+fib(x-2); }'
+assert_run 7  'int main() { putchar(72); putchar(10); exit(7); return 3; }'
+assert_run 21 'int main() { return add6(1, 2, 3, 4, 5, 6); } int add6(int a, int b, int c, int d, int e, int f) { return a+b+c+d+e+f; }'
+assert_run 5  'int main() { int x[2][3]; int *y=x; y[5]=5; return x[1][2]; }'
+assert_run 6  'int main() { long a[37]; long s=0; int i; int n=37; for (i=0; i<n; i=i+1) a[i]=3*i; for (i=0; i<n; i=i+1) s=s+a[i]; return s%256-200; }' -mavx2
+assert_run 2  'int main() { int x=-17; return x/-8%3; }'
+assert_run 42 'int g=40; const int h=2; int main() { g+=h; return g; }'
+
+# Several source files at once are compiled in parallel, each to its own
+# output next to it. They live outside the tree so make does not pick them up.
+if [ -z "$manifest" ]; then
+  dir=$(mktemp -d)
+  echo 'int main() { return twice(ret3()) + 1; }' > "$dir/main.c"
+  echo 'int twice(int x) { return x * 2; }' > "$dir/twice.c"
+  for flags in -j1 -j2 '-j2 -c'; do
+    rm -f "$dir"/*.[so]
+    ./y3c $flags "$dir/main.c" "$dir/twice.c" || exit
+    cc -static -o tmp "$dir"/main.[so] "$dir"/twice.[so] tmp2.o
+    ./tmp
+    actual="$?"
+    if [ "$actual" != 7 ]; then
+      echo "y3c $flags main.c twice.c => 7 expected, but got $actual"
+      exit 1
+    fi
+    echo "y3c $flags main.c twice.c => $actual"
+  done
+
+  # Functions are generated in parallel, with the same output as in order.
+  prog='int f(int x) { if (x) return 1; return 2; } int g(int n) { int a[9]; int i; for (i=0; i<n; i=i+1) a[i]=i; return a[n-1]; } int main() { return f(0)+g(9); }'
+  ./y3c -j1 "$prog" > "$dir/seq.s" || exit
+  ./y3c -j3 "$prog" > "$dir/par.s" || exit
+  if ! cmp -s "$dir/seq.s" "$dir/par.s"; then
+    echo "$prog => output differs between -j1 and -j3"
+    exit 1
+  fi
+  echo "$prog => same output with -j1 and -j3"
+
+  # Function bodies are parsed in parallel, and the first error in source
+  # order is still the one reported.
+  prog='int f() { return 1; } int g() { return x; } int h() { return 1 +; }'
+  ./y3c -j1 "$prog" > /dev/null 2> "$dir/seq.err"
+  ./y3c -j3 "$prog" > /dev/null 2> "$dir/par.err"
+  if ! grep -q 'undefined variable' "$dir/par.err" \
+      || ! cmp -s "$dir/seq.err" "$dir/par.err"; then
+    echo "$prog => different errors with -j1 and -j3"
+    exit 1
+  fi
+  echo "$prog => same error with -j1 and -j3"
+
+  # With --pipeline, the lexer runs on its own thread, and with --stream each
+  # function is also compiled and freed as soon as it is parsed. Both give
+  # the same result, and a lexer error still comes before any parse error.
+  for prog in \
+      'int main() { return g(3); } int g(int x) { if (x) { return x*7; } }' \
+      'int a[2]={1,2}, b[2]={3,4}; int x; int f() { return a[1]+b[0]; } int c[2]={7,8}; int main() { return f()+c[1]+x; }'; do
+    ./y3c "$prog" > "$dir/seq.s" || exit
+    for flag in --pipeline --stream; do
+      ./y3c $flag "$prog" > "$dir/par.s" || exit
+      if ! cmp -s "$dir/seq.s" "$dir/par.s"; then
+        echo "$prog => output differs with $flag"
+        exit 1
+      fi
+      echo "$prog => same output with $flag"
+    done
+  done
+
+  prog='int f() { return x; } int g() { return 1 @ 2; }'
+  ./y3c "$prog" > /dev/null 2> "$dir/seq.err"
+  ./y3c --pipeline "$prog" > /dev/null 2> "$dir/par.err"
+  if ! grep -q 'invalid token' "$dir/par.err" \
+      || ! cmp -s "$dir/seq.err" "$dir/par.err"; then
+    echo "$prog => different errors with --pipeline"
+    exit 1
+  fi
+  echo "$prog => same error with --pipeline"
+
+  # Cached code is the same as freshly generated code, also when only the
+  # return type of a callee changed.
+  for ty in char int char; do
+    prog="$ty f() { return 255; } int main() { return f()+1; }"
+    ./y3c "$prog" > "$dir/seq.s" || exit
+    ./y3c --cache-dir="$dir/cache" "$prog" > "$dir/par.s" || exit
+    if ! cmp -s "$dir/seq.s" "$dir/par.s"; then
+      echo "$prog => output differs with --cache-dir"
+      exit 1
+    fi
+    echo "$prog => same output with --cache-dir"
+  done
+  ./y3c --cache-dir="$dir/cache" --cache-stats "$prog" 2>&1 > /dev/null \
+    | grep -q 'cache: 2 hits, 0 misses' || exit
+
+  # The compile server gives the same results as compiling directly.
+  ./y3c --server="$dir/sock" -j2 &
+  server=$!
+  while [ ! -S "$dir/sock" ]; do sleep 0.1; done
+  for flags in "" "-mavx2" "-fno-unroll-loops"; do
+    ./y3c $flags "$prog" > "$dir/seq.s" || exit
+    ./y3c --client="$dir/sock" $flags "$prog" > "$dir/par.s" || exit
+    if ! cmp -s "$dir/seq.s" "$dir/par.s"; then
+      echo "$prog => output differs with --client $flags"
+      exit 1
+    fi
+    echo "$prog => same output with --client $flags"
+  done
+  prog='int main() { return x; }'
+  ./y3c "$prog" 2> "$dir/seq.err"
+  if ./y3c --client="$dir/sock" "$prog" 2> "$dir/par.err" \
+      || ! cmp -s "$dir/seq.err" "$dir/par.err"; then
+    echo "$prog => error differs with --client"
+    exit 1
+  fi
+  ./y3c --client="$dir/sock" --stats | grep -q 'requests: 4' || exit
+  prog='int main() { return 0; }'
+  if ./y3c --client="$dir/sock" -fprofile-generate -c -o "$dir/p.o" "$prog" \
+      > /dev/null 2> "$dir/par.err" \
+      || ! grep -q "does not work with -c" "$dir/par.err"; then
+    echo "$prog => error expected with --client -fprofile-generate -c"
+    exit 1
+  fi
+  kill $server
+
+  # --stats reports the compilation as JSON.
+  prog='int main() { int x=1; return x+2; }'
+  ./y3c --stats "$prog" 2> "$dir/stats.json" > /dev/null || exit
+  for field in '"parse": {"wall_seconds"' '"tokens": 17' '"NODE_ADD": 1' \
+      '{"name": "main", "instructions": '; do
+    if ! grep -qF "$field" "$dir/stats.json"; then
+      echo "$prog => --stats lacks $field"
+      exit 1
+    fi
+  done
+  echo "$prog => --stats OK"
+
+  # -fprofile-generate counts function entries and branch edges, and
+  # -fprofile-use lays the code out for them without changing its meaning.
+  prog='int f(int x) { if (x%10==0) return 1; return 2; } int main() { int i; int s=0; for (i=0; i<100; i=i+1) { s=s+f(i); if (i==99) s=s+7; } return s; }'
+  ./y3c -fprofile-generate="$dir/prof" "$prog" > "$dir/gen.s" || exit
+  cc -o "$dir/gen" "$dir/gen.s" 2> /dev/null || exit
+  "$dir/gen"
+  actual=$?
+  printf 'f 0 100\nf 1 10\nf 2 90\nmain 0 1\nmain 1 100\nmain 2 1\nmain 3 1\nmain 4 99\n' \
+    | cmp -s - "$dir/prof" || { echo "$prog => wrong profile"; exit 1; }
+  ./y3c -fprofile-use="$dir/prof" "$prog" > "$dir/use.s" || exit
+  grep -q '^.L.then.main.2:' "$dir/use.s" || exit
+  cc -o "$dir/use" "$dir/use.s" 2> /dev/null || exit
+  "$dir/use"
+  if [ "$?" != 197 ] || [ "$actual" != 197 ]; then
+    echo "$prog => 197 expected with -fprofile-generate and -fprofile-use"
+    exit 1
+  fi
+  echo "$prog => 197 with -fprofile-generate and -fprofile-use"
+
+  # -g maps instructions to source lines, and errors show only their line.
+  printf 'int main() {\n  int x=5;\n  return x+2;\n}\n' > "$dir/lines.c"
+  ./y3c -g -o "$dir/lines.s" "$dir/lines.c" || exit
+  cc -g -o "$dir/lines" "$dir/lines.s" 2> /dev/null || exit
+  objdump --dwarf=decodedline "$dir/lines" | grep -q 'lines.c  *3 ' || {
+    echo "lines.c => no line table entry for line 3"
+    exit 1
+  }
+  ./y3c -c -g -o "$dir/lines.o" "$dir/lines.c" || exit
+  printf 'int main() {\n  return y;\n}\n' > "$dir/error.c"
+  ./y3c "$dir/error.c" 2> "$dir/error.err" && exit 1
+  where="$dir/error.c:2:   return "
+  printf '%sy;\n%*s^ undefined variable.\n' "$where" ${#where} '' \
+    | cmp -s - "$dir/error.err" || {
+    echo "error.c => wrong error location"
+    exit 1
+  }
+  echo "lines.c => line tables and error lines OK"
+
+  # Increments whose value is unused update memory in place.
+  ./y3c 'int main() { int i; int s=0; for (i=0; i<n(); i++) s-=2; return s; }' \
+    > "$dir/inc.s" || exit
+  grep -q 'add dword ptr \[rbp-[0-9]*\], 1' "$dir/inc.s" \
+    && grep -q 'sub dword ptr \[rbp-[0-9]*\], 2' "$dir/inc.s" || {
+    echo "i++ => add dword ptr [rbp-N], 1 expected"
+    exit 1
+  }
+
+  # Loops that fill or copy arrays become rep stos and rep movs.
+  ./y3c 'int f(long *a, long *b, int n) { int i; for (i=0; i<n; i++) a[i]=0; for (i=0; i<n; i++) b[i]=a[i]; return 0; }' \
+    > "$dir/idiom.s" || exit
+  grep -q 'rep stosq' "$dir/idiom.s" && grep -q 'rep movsq' "$dir/idiom.s" || {
+    echo "a[i]=0 and b[i]=a[i] => rep stosq and rep movsq expected"
+    exit 1
+  }
+
+  # Globals are written only if they are not const, and defined only once.
+  for prog in 'const int k=1; int main() { k=2; return k; }' \
+      'int g; long g; int main() { return 0; }' \
+      'int a[2]={1,2,3}; int main() { return 0; }'; do
+    if ./y3c "$prog" > /dev/null 2> "$dir/global.err" \
+        || ! grep -qE 'const variable|duplicate global|too many' \
+          "$dir/global.err"; then
+      echo "$prog => error expected"
+      exit 1
+    fi
+    echo "$prog => error"
+  done
+
+  # Labels that belong to no switch, or to the same case, are errors.
+  for prog in 'int main() { switch (1) { case 1: case 1: return 2; } }' \
+      'int main() { int i; switch (1) { case 1: for (;;) break; } }'; do
+    if ./y3c "$prog" > /dev/null 2> "$dir/switch.err" \
+        || ! grep -qE 'duplicate case|break outside' "$dir/switch.err"; then
+      echo "$prog => error expected"
+      exit 1
+    fi
+    echo "$prog => error"
+  done
+  rm -rf "$dir"
+fi
+
+# Division and modulo by constants are strength-reduced, so check them against
+# idiv with the same divisor passed through a variable.
+for d in 1 2 3 5 6 7 8 10 16 25 60 100 125 641 1000 65536 \
+    2147483647 -1 -2 -3 -7 -8 -10 -1024 -2147483647 -2147483648; do
+  edges='chk(0)+chk(1)+chk(-1)+chk(7)+chk(-7)+chk(99)+chk(-99)+chk(12345)'
+  edges="$edges+chk(-12345)+chk(2147483647)+chk(-2147483647-1)+chk(m-1)+chk(m+1)"
+  if [ "$d" != "-1" ]; then
+    edges="$edges+chk(m)"
+  fi
+  assert 0 "long chk(long n) { long d=$d; return (n/$d!=n/d)+(n%$d!=n%d)+(n*$d!=n*d); } int main() { long m=(-2147483647-1)*65536*65536; return $edges; }"
+done
+
 echo OK
\ No newline at end of file
@@ -0,0 +1,69 @@
+#!/bin/bash
+# Compile-throughput benchmark for "make bench".
+#
+# Usage: test/bench.sh OUTPUT.csv [BASELINE.csv]
+#
+# Compiles synthetic programs from test/gen.c of several shapes and sizes,
+# and writes y3c's lines/sec, tokens/sec and peak RSS for each to
+# OUTPUT.csv. Each program is compiled $RUNS times and the fastest run
+# counts. With a BASELINE.csv from an earlier run, fails if any program
+# compiles more than $THRESHOLD percent slower than it did then.
+out="$1"
+baseline="$2"
+runs=${RUNS:-3}
+threshold=${THRESHOLD:-20}
+if [ -z "$out" ]; then
+  echo "usage: $0 OUTPUT.csv [BASELINE.csv]"
+  exit 1
+fi
+
+# name and generator options of each program.
+programs=(
+  "small       -f 100"
+  "functions   -f 5000"
+  "deep        -f 200 -d 400"
+  "locals      -f 200 -l 500"
+  "arrays      -f 1000 -a 100000"
+  "loops       -f 200 -b 500"
+  "large       -f 2000 -d 32 -l 32 -b 32"
+)
+
+dir=$(mktemp -d)
+echo "name,lines,tokens,seconds,lines_per_sec,tokens_per_sec,max_rss_kb" \
+  > "$out"
+for p in "${programs[@]}"; do
+  set -- $p
+  name=$1
+  shift
+  ./tmp-gen "$@" > "$dir/$name.c" || exit
+  lines=$(wc -l < "$dir/$name.c")
+
+  best=
+  for i in $(seq "$runs"); do
+    ./y3c -j1 --stats "$dir/$name.c" 2> "$dir/stats.json" > /dev/null || exit
+    seconds=$(sed -n 's/^  "wall_seconds": \(.*\),$/\1/p' "$dir/stats.json")
+    if [ -z "$best" ] || awk "BEGIN { exit !($seconds < $best) }"; then
+      best=$seconds
+      tokens=$(sed -n 's/^  "tokens": \(.*\),$/\1/p' "$dir/stats.json")
+      rss=$(sed -n 's/^  "max_rss_kb": \(.*\),$/\1/p' "$dir/stats.json")
+    fi
+  done
+  awk -v name="$name" -v lines="$lines" -v tokens="$tokens" -v s="$best" \
+      -v rss="$rss" 'BEGIN {
+    printf "%s,%d,%d,%.6f,%.0f,%.0f,%d\n",
+      name, lines, tokens, s, lines / s, tokens / s, rss
+  }' | tee -a "$out"
+done
+rm -rf "$dir"
+
+if [ -n "$baseline" ]; then
+  # Join on the name and compare lines/sec.
+  awk -F, -v threshold="$threshold" '
+    FNR == 1 { next }
+    NR == FNR { base[$1] = $5; next }
+    ($1 in base) && $5 < base[$1] * (100 - threshold) / 100 {
+      printf "%s: %d lines/sec, down from %d\n", $1, $5, base[$1]
+      failed = 1
+    }
+    END { exit failed }' "$baseline" "$out" || exit
+fi
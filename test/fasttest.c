@@ -0,0 +1,47 @@
+// Test harness for "make fasttest".
+//
+// Runs every case that "y3c --batch" compiled into y3c_cases, in this one
+// process, and reports each case's result and running time.
+
+#include <stdio.h>
+#include <time.h>
+
+struct Case {
+    int (*main)(void);
+    long expected;
+    char *source;
+};
+
+extern struct Case y3c_cases[];
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(void) {
+    int ncases = 0;
+    int nfailed = 0;
+    double start = now_us();
+
+    for (struct Case *c = y3c_cases; c->main; c++, ncases++) {
+        double t = now_us();
+        // Compare like an exit status would.
+        int actual = c->main() & 0xff;
+        t = now_us() - t;
+
+        if (actual == c->expected) {
+            printf("%9.1fus  %s => %d\n", t, c->source, actual);
+        }
+        else {
+            printf("%9.1fus  %s => %ld expected, but got %d\n",
+                t, c->source, c->expected, actual);
+            nfailed++;
+        }
+    }
+
+    printf("%d cases, %d failed, %.1fms\n",
+        ncases, nfailed, (now_us() - start) / 1e3);
+    return nfailed != 0;
+}
@@ -0,0 +1,100 @@
+// Synthetic program generator for "make bench".
+//
+// Prints a program in the subset y3c supports, sized by these options:
+//
+//   -f N   number of functions
+//   -d N   nesting depth of the expression each function returns
+//   -l N   locals per function
+//   -a N   elements of each function's local array
+//   -b N   statements in the body of each function's loop
+//
+// Each function calls the one before it, so the program is valid C, but it
+// is meant to be compiled rather than run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int nfuncs = 100;
+static int depth = 8;
+static int nlocals = 8;
+static int array_size = 16;
+static int body_size = 4;
+
+// Prints an expression |d| levels deep. It nests to the left, so that
+// evaluating it needs two registers however deep it is.
+static void expr(int d, int fn) {
+    static char *ops[] = { "+", "-", "*" };
+    if (d == 0) {
+        printf("x");
+        return;
+    }
+    printf("(");
+    expr(d - 1, fn);
+    printf("%s", ops[(d + fn) % 3]);
+    if (d % 2) {
+        printf("v%d", d % nlocals);
+    }
+    else {
+        printf("%d", d % 7 + 1);
+    }
+    printf(")");
+}
+
+static void function(int fn) {
+    printf("int f%d(int x) {\n", fn);
+    for (int i = 0; i < nlocals; ++i) {
+        printf("    int v%d=x+%d;\n", i, i);
+    }
+    printf("    int a[%d];\n", array_size);
+    printf("    int i;\n");
+    printf("    int s=0;\n");
+    printf("    for (i=0; i<%d; i=i+1) {\n", array_size);
+    printf("        a[i]=i;\n");
+    for (int i = 0; i < body_size; ++i) {
+        printf("        a[i]=a[i]+v%d*%d;\n", i % nlocals, i + 1);
+    }
+    printf("    }\n");
+    printf("    for (i=0; i<%d; i=i+1) s=s+a[i];\n", array_size);
+    printf("    return s+");
+    expr(depth, fn);
+    if (fn > 0) {
+        printf("+f%d(v0)", fn - 1);
+    }
+    printf(";\n}\n");
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        int n = atoi(argv[i + 1]);
+        if (!strcmp(argv[i], "-f")) {
+            nfuncs = n;
+        }
+        else if (!strcmp(argv[i], "-d")) {
+            depth = n;
+        }
+        else if (!strcmp(argv[i], "-l")) {
+            nlocals = n;
+        }
+        else if (!strcmp(argv[i], "-a")) {
+            array_size = n;
+        }
+        else if (!strcmp(argv[i], "-b")) {
+            body_size = n;
+        }
+        else {
+            fprintf(stderr, "gen: unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (nfuncs < 1 || nlocals < 1 || array_size < 1) {
+        fprintf(stderr, "gen: -f, -l and -a must be positive\n");
+        return 1;
+    }
+
+    for (int i = 0; i < nfuncs; ++i) {
+        function(i);
+    }
+    printf("int main() { return f%d(1); }\n", nfuncs - 1);
+    return 0;
+}
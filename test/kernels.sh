@@ -0,0 +1,100 @@
+#!/bin/bash
+# Generated-code benchmark for "make kernels".
+#
+# Usage: test/kernels.sh OUTPUT.csv
+#
+# Compiles each kernel in test/kernels with y3c, gcc -O0 and gcc -O2, links
+# it with the timing driver test/timer.c, and writes how long each version
+# ran and y3c's time relative to gcc's to OUTPUT.csv. Each version runs
+# $RUNS times and the fastest run counts. The kernels are:
+#
+#   fib        naive recursive Fibonacci
+#   sum        sums an array, the vectorizer's reduction pattern
+#   matmul     64x64 integer matrix multiply
+#   sieve      sieve of Eratosthenes below 1000000
+#   chase      follows links through a permutation, one dependent load each
+#   ackermann  A(2, 500), deep recursion that is almost all calls
+#
+# If perf(1) works here, the instructions each version executed are
+# reported too. All versions must compute the same result.
+out="$1"
+runs=${RUNS:-3}
+if [ -z "$out" ]; then
+  echo "usage: $0 OUTPUT.csv"
+  exit 1
+fi
+
+# Kernels and their n.
+kernels=(
+  "fib        32"
+  "sum        5000"
+  "matmul     50"
+  "sieve      10"
+  "chase      20000000"
+  "ackermann  50"
+)
+compilers=(y3c gcc-O0 gcc-O2)
+
+perf=
+if perf stat -x, -e instructions:u true > /dev/null 2>&1; then
+  perf=1
+fi
+
+dir=$(mktemp -d)
+gcc -O2 -c -o "$dir/timer.o" test/timer.c || exit
+
+header="kernel,n"
+for c in "${compilers[@]}"; do
+  header="$header,${c}_seconds"
+done
+header="$header,y3c_vs_gcc-O0,y3c_vs_gcc-O2"
+if [ -n "$perf" ]; then
+  for c in "${compilers[@]}"; do
+    header="$header,${c}_instructions"
+  done
+fi
+echo "$header" > "$out"
+
+for k in "${kernels[@]}"; do
+  set -- $k
+  name=$1
+  n=$2
+  src=test/kernels/$name.c
+
+  ./y3c "$src" > "$dir/$name.s" || exit
+  gcc -o "$dir/y3c" "$dir/$name.s" "$dir/timer.o" 2> /dev/null || exit
+  gcc -O0 -o "$dir/gcc-O0" "$src" "$dir/timer.o" || exit
+  gcc -O2 -o "$dir/gcc-O2" "$src" "$dir/timer.o" || exit
+
+  expected=
+  times=
+  insns=
+  for c in "${compilers[@]}"; do
+    best=
+    for i in $(seq "$runs"); do
+      set -- $("$dir/$c" "$n")
+      if [ -z "$expected" ]; then
+        expected=$1
+      elif [ "$1" != "$expected" ]; then
+        echo "$name: $c computed $1, but y3c computed $expected"
+        exit 1
+      fi
+      if [ -z "$best" ] || awk "BEGIN { exit !($2 < $best) }"; then
+        best=$2
+      fi
+    done
+    times="$times $best"
+    if [ -n "$perf" ]; then
+      insns="$insns,$(perf stat -x, -e instructions:u "$dir/$c" "$n" \
+        2>&1 > /dev/null | cut -d, -f1)"
+    fi
+  done
+
+  set -- $times
+  awk -v name="$name" -v n="$n" -v y3c="$1" -v o0="$2" -v o2="$3" \
+      -v insns="$insns" 'BEGIN {
+    printf "%s,%d,%.6f,%.6f,%.6f,%.2f,%.2f%s\n",
+      name, n, y3c, o0, o2, y3c / o0, y3c / o2, insns
+  }' | tee -a "$out"
+done
+rm -rf "$dir"
@@ -0,0 +1,15 @@
+int ack(int m, int n) {
+    if (m == 0)
+        return n + 1;
+    if (n == 0)
+        return ack(m - 1, 1);
+    return ack(m - 1, ack(m, n - 1));
+}
+
+int run(int n) {
+    int r;
+    int s=0;
+    for (r=0; r<n; r=r+1)
+        s=s+ack(2, 500);
+    return s;
+}
@@ -0,0 +1,13 @@
+int run(int n) {
+    int next[100003];
+    int i;
+    for (i=0; i<100003; i=i+1)
+        next[i]=(i*7919+12345)%100003;
+    int *p=next;
+    int sum=0;
+    for (i=0; i<n; i=i+1) {
+        sum=sum+*p;
+        p=next+*p;
+    }
+    return sum;
+}
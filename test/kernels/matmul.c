@@ -0,0 +1,26 @@
+int run(int n) {
+    int a[64][64];
+    int b[64][64];
+    int c[64][64];
+    int i;
+    int j;
+    int k;
+    int r;
+    for (i=0; i<64; i=i+1) {
+        for (j=0; j<64; j=j+1) {
+            a[i][j]=i+j;
+            b[i][j]=i-j;
+        }
+    }
+    for (r=0; r<n; r=r+1) {
+        for (i=0; i<64; i=i+1) {
+            for (j=0; j<64; j=j+1) {
+                int s=0;
+                for (k=0; k<64; k=k+1)
+                    s=s+a[i][k]*b[k][j];
+                c[i][j]=s+r;
+            }
+        }
+    }
+    return c[7][9]+c[63][1];
+}
@@ -0,0 +1,20 @@
+int run(int n) {
+    char flags[1000000];
+    int count=0;
+    int r;
+    int i;
+    int j;
+    for (r=0; r<n; r=r+1) {
+        count=0;
+        for (i=0; i<1000000; i=i+1)
+            flags[i]=1;
+        for (i=2; i<1000000; i=i+1) {
+            if (flags[i]) {
+                count=count+1;
+                for (j=i+i; j<1000000; j=j+i)
+                    flags[j]=0;
+            }
+        }
+    }
+    return count;
+}
@@ -0,0 +1,12 @@
+int run(int n) {
+    int a[10000];
+    int i;
+    int r;
+    int s=0;
+    for (i=0; i<10000; i=i+1)
+        a[i]=i%100;
+    for (r=0; r<n; r=r+1)
+        for (i=0; i<10000; i=i+1)
+            s=s+a[i];
+    return s;
+}
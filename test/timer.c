@@ -0,0 +1,29 @@
+// Timing driver for "make kernels".
+//
+// Links with one kernel from test/kernels, calls its run(n) with the n
+// given on the command line, and prints the result and how long run()
+// took. n comes from outside so that no compiler can fold the kernel away.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+int run(int n);
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s N\n", argv[0]);
+        return 1;
+    }
+    int n = atoi(argv[1]);
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int result = run(n);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%d %.6f\n", result, (end.tv_sec - start.tv_sec)
+        + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return 0;
+}
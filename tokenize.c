@@ -1,38 +1,139 @@
 #include "y3c.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
 // Input string
-static char *current_input;
+static _Thread_local char *current_input;
+// Line the lexer is on in |current_input|
+static _Thread_local int current_line;
+
+// Names of the inputs read from files, for error messages and line tables.
+// Programs given on the command line have none.
+typedef struct InputName InputName;
+struct InputName {
+    char *input;
+    char *name;
+    InputName *next;
+};
+
+static InputName *input_names;
+static pthread_mutex_t input_names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local ErrorTrap *error_trap;
+
+// Returns where errors go: the trap's message buffer or stderr.
+static FILE *error_stream(void) {
+    if (!error_trap) {
+        return stderr;
+    }
+    size_t len;
+    return open_memstream(&error_trap->msg, &len);
+}
+
+// Exits, or returns to the trap with the message written to |out|.
+static void error_exit(FILE *out) {
+    if (!error_trap) {
+        exit(1);
+    }
+    fclose(out);
+    ErrorTrap *trap = error_trap;
+    error_trap = NULL;
+    longjmp(trap->env, 1);
+}
 
 // Reports an error and exit.
 void error(char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    FILE *out = error_stream();
+    vfprintf(out, fmt, ap);
+    fprintf(out, "\n");
+    error_exit(out);
+}
+
+// Reports an error location on line |line| and exit. Only that line of
+// the input is printed, prefixed with the file name and line number if the
+// input came from a file.
+static void compile_error_at(char *token_string, int line, char *fmt,
+    va_list ap) {
+    char *start = token_string;
+    while (start > current_input && start[-1] != '\n') {
+        start--;
+    }
+    char *end = token_string;
+    while (*end && *end != '\n') {
+        end++;
+    }
+    FILE *out = error_stream();
+    int indent = 0;
+    char *name = get_input_name(current_input);
+    if (name) {
+        indent = fprintf(out, "%s:%d: ", name, line);
+    }
+    fprintf(out, "%.*s\n", (int)(end - start), start);
+    fprintf(out, "%*s", indent + (int)(token_string - start), "");
+    fprintf(out, "^ ");
+    vfprintf(out, fmt, ap);
+    fprintf(out, "\n");
+    error_exit(out);
+}
+
+// Returns the input being compiled on this thread.
+char *get_current_input(void) {
+    return current_input;
+}
+
+// Records that |input| was read from the file |name|.
+void set_input_name(char *input, char *name) {
+    InputName *in = calloc(1, sizeof(InputName));
+    in->input = input;
+    in->name = name;
+    pthread_mutex_lock(&input_names_lock);
+    in->next = input_names;
+    input_names = in;
+    pthread_mutex_unlock(&input_names_lock);
 }
 
-// Reports an error location and exit.
-static void compile_error_at(char *token_string, char *fmt, va_list ap) {
-    int pos = token_string - current_input;
-    fprintf(stderr, "%s\n", current_input);
-    fprintf(stderr, "%*s", pos, "");
-    fprintf(stderr, "^ ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
+// Returns the name of the file |input| was read from, or NULL.
+char *get_input_name(char *input) {
+    pthread_mutex_lock(&input_names_lock);
+    InputName *in = input_names;
+    while (in && in->input != input) {
+        in = in->next;
+    }
+    pthread_mutex_unlock(&input_names_lock);
+    return in ? in->name : NULL;
+}
+
+// Compiles |input| on this thread, catching errors with |trap| until one
+// occurs. The caller must setjmp(trap->env) first. A null |trap| makes
+// errors exit again.
+void set_error_trap(ErrorTrap *trap, char *input) {
+    current_input = input;
+    if (trap) {
+        trap->msg = NULL;
+    }
+    error_trap = trap;
+}
+
+// Prints the error caught by |trap| and exits.
+void report_trapped_error(ErrorTrap *trap) {
+    fputs(trap->msg, stderr);
     exit(1);
 }
 
 static void error_at(char *token_string, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    compile_error_at(token_string, fmt, ap);
+    compile_error_at(token_string, current_line, fmt, ap);
 }
 
 void error_tok(Token *tok, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    compile_error_at(tok->token_string, fmt, ap);
+    compile_error_at(tok->token_string, tok->line, fmt, ap);
 }
 
 // Check that the current token equals to |s|.
@@ -57,15 +158,16 @@ bool consume(Token **rest, Token *tok, char *str) {
     return false;
 }
 
-// Adds the token information for |kind| and |str| after |tail|.
-static Token *create_new_token(Token *tail, TokenKind kind, char *token_string,
+// Creates a token for |kind| and |str|.
+static Token *create_new_token(TokenKind kind, char *token_string,
     int token_length) {
 
-    Token *tok = calloc(1, sizeof(Token));
+    count_token();
+    Token *tok = arena_calloc(1, sizeof(Token));
     tok->kind = kind;
     tok->token_string = token_string;
     tok->token_length = token_length;
-    tail->next = tok;
+    tok->line = current_line;
     return tok;
 }
 
@@ -82,7 +184,10 @@ static bool is_alnum_or_underscore(char c) {
 }
 
 static int is_keyword(char *p) {
-    static char *kw[] = { "return", "if", "else", "for", "while", "int" };
+    static char *kw[] = {
+        "return", "if", "else", "for", "while", "char", "short", "int", "long",
+        "switch", "case", "default", "break", "const",
+    };
     for (int i = 0; i < (int)(sizeof(kw) / sizeof(*kw)); ++i) {
         int n = strlen(kw[i]);
         if (prefix_matchs(p, kw[i]) && !is_alnum_or_underscore(p[n])) {
@@ -92,67 +197,230 @@ static int is_keyword(char *p) {
     return false;
 }
 
+// Reads the token at |p|, after any white space, and sets |*rest| to the
+// input after it. Returns a TOKEN_EOF token at the end of the input.
+static Token *read_token(char **rest, char *p) {
+    // Skips white-space characters.
+    while (isspace(*p)) {
+        if (*p == '\n') {
+            ++current_line;
+        }
+        p++;
+    }
+    Token *tok;
+
+    if (!*p) {
+        tok = create_new_token(TOKEN_EOF, p, 0);
+    }
+    // Keyword
+    else if (is_keyword(p)) {
+        int keyword_length = is_keyword(p);
+        tok = create_new_token(TOKEN_SYMBOL, p, keyword_length);
+        p += keyword_length;
+    }
+    // Identifier
+    else if (is_alpha_or_underscore(*p)) {
+        char *q = p;
+        while (is_alnum_or_underscore(*p)) {
+            p++;
+        }
+        tok = create_new_token(TOKEN_IDENTIFIER, q, p - q);
+    }
+    // Multi-letter punctuators
+    else if (prefix_matchs(p, "==") || prefix_matchs(p, "!=")
+        || prefix_matchs(p, "<=") || prefix_matchs(p, ">=")
+        || prefix_matchs(p, "&&") || prefix_matchs(p, "||")
+        || prefix_matchs(p, "+=") || prefix_matchs(p, "-=")
+        || prefix_matchs(p, "*=") || prefix_matchs(p, "/=")
+        || prefix_matchs(p, "++") || prefix_matchs(p, "--")) {
+        tok = create_new_token(TOKEN_SYMBOL, p, 2);
+        p += 2;
+    }
+    // Single-letter punctuators
+    else if (strchr("+-*/%&!(){}<>=,;:[]", *p)) {
+        tok = create_new_token(TOKEN_SYMBOL, p, 1);
+        p++;
+    }
+    // Integer literal
+    else if (isdigit(*p)) {
+        tok = create_new_token(TOKEN_NUM, p, 0);
+        char *q = p;
+        tok->val = strtoul(p, &p, 10);
+        tok->token_length = p - q;
+    }
+    else {
+        error_at(p, "invalid token.");
+    }
+    *rest = p;
+    return tok;
+}
+
 // Tokenize |p| and returns token's head.
 Token *tokenize(char *p) {
+    Phase prev = enter_phase(PHASE_TOKENIZE);
     current_input = p;
+    current_line = 1;
     Token head;
     head.next = NULL;
     Token *tail = &head;
 
-    while (*p) {
-        // Skips white-space characters.
-        if (isspace(*p)) {
-            p++;
-            continue;
-        }
+    do {
+        tail = tail->next = read_token(&p, p);
+    } while (tail->kind != TOKEN_EOF);
+    enter_phase(prev);
+    return head.next;
+}
 
-        // Keyword
-        if (is_keyword(p)) {
-            int keyword_length = is_keyword(p);
-            tail = create_new_token(tail, TOKEN_SYMBOL, p, keyword_length);
-            p += keyword_length;
-            continue;
-        }
+//
+// Token stream
+//
+// The lexer can also run on a thread of its own, ahead of the parser. It
+// hands over the tokens of one top-level function at a time, split after
+// each "}" that closes an outermost "{", through a lock-free ring buffer
+// with a single producer and a single consumer.
+//
 
-        // Identifier
-        if (is_alpha_or_underscore(*p)) {
-            char *q = p;
-            while (is_alnum_or_underscore(*p)) {
-                p++;
-            }
-            tail = create_new_token(tail, TOKEN_IDENTIFIER, q, p - q);
-            continue;
-        }
+#define STREAM_CAPACITY 64
 
-        // Multi-letter punctuators
-        if (prefix_matchs(p, "==") || prefix_matchs(p, "!=")
-            || prefix_matchs(p, "<=") || prefix_matchs(p, ">=")) {
-            tail = create_new_token(tail, TOKEN_SYMBOL, p, 2);
-            p += 2;
-            continue;
-        }
+typedef struct Batch Batch;
+struct Batch {
+    Token *head;
+    Token *tail;
+    Arena *arena;  // Where the tokens are allocated
+    char *error;   // The lexer's error message, instead of tokens
+    Batch *next;   // Next batch handed to the parser
+};
 
-        // Single-letter punctuators
-        if (strchr("+-*/&(){}<>=,;[]", *p)) {
-            tail = create_new_token(tail, TOKEN_SYMBOL, p, 1);
-            p++;
-            continue;
-        }
+struct TokenStream {
+    Batch ring[STREAM_CAPACITY];
+    _Atomic size_t head;   // Next slot to read, only advanced by the parser
+    _Atomic size_t tail;   // Next slot to write, only advanced by the lexer
+    char *input;
+    pthread_t thread;
+    Batch *handed_out;     // Batches handed to the parser, oldest first
+    Batch *last;
+    bool done;
+};
+
+static void push_batch(TokenStream *s, Batch batch) {
+    size_t tail = atomic_load_explicit(&s->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&s->head, memory_order_acquire)
+        == STREAM_CAPACITY) {
+        sched_yield();
+    }
+    s->ring[tail % STREAM_CAPACITY] = batch;
+    atomic_store_explicit(&s->tail, tail + 1, memory_order_release);
+}
+
+static Batch pop_batch(TokenStream *s) {
+    size_t head = atomic_load_explicit(&s->head, memory_order_relaxed);
+    while (atomic_load_explicit(&s->tail, memory_order_acquire) == head) {
+        sched_yield();
+    }
+    Batch batch = s->ring[head % STREAM_CAPACITY];
+    atomic_store_explicit(&s->head, head + 1, memory_order_release);
+    return batch;
+}
 
-        // Integer literal
-        if (isdigit(*p)) {
-            tail = create_new_token(tail, TOKEN_NUM, p, 0);
-            char *q = p;
-            tail->val = strtoul(p, &p, 10);
-            tail->token_length = p - q;
-            continue;
+static void *lexer_thread(void *arg) {
+    TokenStream *s = arg;
+    ErrorTrap trap;
+    if (setjmp(trap.env)) {
+        push_batch(s, (Batch) { .error = trap.msg });
+        return NULL;
+    }
+    set_error_trap(&trap, s->input);
+    enter_phase(PHASE_TOKENIZE);
+
+    char *p = s->input;
+    current_line = 1;
+    int depth = 0;
+    Batch batch = { .arena = new_arena() };
+    use_arena(batch.arena);
+    for (;;) {
+        Token *tok = read_token(&p, p);
+        if (batch.head) {
+            batch.tail->next = tok;
+        }
+        else {
+            batch.head = tok;
         }
+        batch.tail = tok;
+        if (tok->kind == TOKEN_EOF) {
+            break;
+        }
+        if (equal(tok, "{")) {
+            ++depth;
+        }
+        else if (equal(tok, "}") && --depth == 0) {
+            push_batch(s, batch);
+            batch = (Batch) { .arena = new_arena() };
+            use_arena(batch.arena);
+        }
+    }
+    push_batch(s, batch);
+    use_arena(NULL);
+    enter_phase(PHASE_NONE);
+    return NULL;
+}
 
-        error_at(p, "invalid token.");
+// Starts tokenizing |p| on a new thread.
+TokenStream *tokenize_async(char *p) {
+    current_input = p;
+    TokenStream *s = calloc(1, sizeof(TokenStream));
+    s->input = p;
+    if (pthread_create(&s->thread, NULL, lexer_thread, s)) {
+        error("cannot create a thread");
     }
+    return s;
+}
 
-    create_new_token(tail, TOKEN_EOF, p, 0);
-    return head.next;
+// Waits for the tokens of the next top-level function, links them after the
+// ones returned before, and returns the first of them. Returns NULL once the
+// EOF token has been handed out. A lexer error is reported once the parser
+// has caught up with it, and exits.
+Token *next_tokens(TokenStream *s) {
+    if (s->done) {
+        return NULL;
+    }
+    Batch batch = pop_batch(s);
+    if (batch.error) {
+        fputs(batch.error, stderr);
+        exit(1);
+    }
+    Batch *b = calloc(1, sizeof(Batch));
+    *b = batch;
+    if (s->last) {
+        s->last->tail->next = b->head;
+        s->last->next = b;
+    }
+    else {
+        s->handed_out = b;
+    }
+    s->last = b;
+    if (b->tail->kind == TOKEN_EOF) {
+        s->done = true;
+        pthread_join(s->thread, NULL);
+    }
+    return b->head;
+}
+
+// Frees the tokens handed out before |tok|, if |tok| starts a function.
+// The parser must not refer to any of them anymore.
+void release_tokens(TokenStream *s, Token *tok) {
+    Batch *b = s->handed_out;
+    while (b && b->head != tok) {
+        b = b->next;
+    }
+    if (!b) {
+        return;
+    }
+    while (s->handed_out != b) {
+        Batch *old = s->handed_out;
+        s->handed_out = old->next;
+        free_arena(old->arena);
+        free(old);
+    }
 }
 
 void print_all_token(Token* head) {
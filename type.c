@@ -1,59 +1,65 @@
 #include "y3c.h"
 
-Type *ty_int = &(Type) { TY_INT, 8 };
+Type *ty_char = &(Type) { .kind = TY_CHAR, .size = 1, .align = 1 };
+Type *ty_short = &(Type) { .kind = TY_SHORT, .size = 2, .align = 2 };
+Type *ty_int = &(Type) { .kind = TY_INT, .size = 4, .align = 4 };
+Type *ty_long = &(Type) { .kind = TY_LONG, .size = 8, .align = 8 };
 
 bool is_integer(Type *ty) {
-    return ty->kind == TY_INT;
+    TypeKind k = ty->kind;
+    return k == TY_CHAR || k == TY_SHORT || k == TY_INT || k == TY_LONG;
 }
 
 Type *copy_type(Type *ty) {
-    Type *ret = calloc(1, sizeof(Type));
+    Type *ret = arena_calloc(1, sizeof(Type));
     *ret = *ty;
     return ret;
 }
 
 Type *pointer_to(Type *base) {
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_calloc(1, sizeof(Type));
     ty->kind = TY_PTR;
     ty->size = 8;
+    ty->align = 8;
     ty->base = base;
     return ty;
 }
 
 Type *func_type(Type *return_ty) {
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_calloc(1, sizeof(Type));
     ty->kind = TY_FUNC;
     ty->return_ty = return_ty;
     return ty;
 }
 
 Type *array_of(Type *base, int len) {
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_calloc(1, sizeof(Type));
     ty->kind = TY_ARRAY;
     ty->size = base->size * len;
+    ty->align = base->align;
     ty->base = base;
     ty->array_length = len;
     return ty;
 }
 
-void add_type(Node *node) {
+static void visit(Node *node) {
     if (!node || node->ty) {
         return;
     }
 
-    add_type(node->lhs);
-    add_type(node->rhs);
-    add_type(node->cond);
-    add_type(node->then);
-    add_type(node->els);
-    add_type(node->init);
-    add_type(node->inc);
+    visit(node->lhs);
+    visit(node->rhs);
+    visit(node->cond);
+    visit(node->then);
+    visit(node->els);
+    visit(node->init);
+    visit(node->inc);
 
     for (Node *n = node->body; n; n = n->next) {
-        add_type(n);
+        visit(n);
     }
     for (Node *n = node->args; n; n = n->next) {
-        add_type(n);
+        visit(n);
     }
 
     switch (node->kind) {
@@ -61,7 +67,14 @@ void add_type(Node *node) {
     case NODE_SUB:
     case NODE_MUL:
     case NODE_DIV:
+    case NODE_MOD:
     case NODE_ASSIGN:
+    case NODE_ADD_ASSIGN:
+    case NODE_SUB_ASSIGN:
+    case NODE_MUL_ASSIGN:
+    case NODE_DIV_ASSIGN:
+    case NODE_POST_INC:
+    case NODE_POST_DEC:
         node->ty = node->lhs->ty;
         return;
     case NODE_EQ:
@@ -70,6 +83,9 @@ void add_type(Node *node) {
     case NODE_LE:
     case NODE_GT:
     case NODE_GE:
+    case NODE_LOGAND:
+    case NODE_LOGOR:
+    case NODE_NOT:
     case NODE_NUM:
     case NODE_FUNCTION_CALL:
         node->ty = ty_int;
@@ -91,11 +107,26 @@ void add_type(Node *node) {
         }
         node->ty = node->lhs->ty->base;
         return;
+    case NODE_SWITCH:
+        if (!is_integer(node->cond->ty)) {
+            error_tok(node->cond->tok, "switch on a non-integer.");
+        }
+        return;
     case NODE_RETURN:
     case NODE_IF:
     case NODE_FOR:
     case NODE_BLOCK:
+    case NODE_CASE:
+    case NODE_BREAK:
     case NODE_EXPR_STATEMENT:
         return;
     }
-}
\ No newline at end of file
+}
+void add_type(Node *node) {
+    if (!node || node->ty) {
+        return;
+    }
+    Phase prev = enter_phase(PHASE_ADD_TYPE);
+    visit(node);
+    enter_phase(prev);
+}
@@ -0,0 +1,372 @@
+#include "y3c.h"
+
+// Loop vectorizer and loop idiom recognition.
+//
+// Recognizes counted loops of the form
+//
+//   for (init; i < n; i = i + 1) c[i] = a[i] + b[i];   (or '-')
+//   for (init; i < n; i = i + 1) s = s + a[i];
+//   for (init; i < n; i = i + 1) c[i] = v;
+//   for (init; i < n; i = i + 1) c[i] = a[i];
+//
+// where the increment may also be i += 1, ++i or i++, and the sum s += a[i].
+//
+// over arrays of, or pointers to, integers. For the first two, it emits a
+// SIMD loop that handles a full vector register of elements per iteration
+// in front of the ordinary scalar loop. The scalar loop then runs the
+// remaining iterations, so it doubles as the epilogue and as the fallback
+// when a runtime alias check fails. Fills and copies instead run all their
+// iterations as one rep stos or rep movs, which leaves the scalar loop
+// nothing to do.
+
+typedef struct Loop Loop;
+struct Loop {
+    Var *iv;       // Induction variable
+    Node *bound;   // NODE_NUM or NODE_VAR
+
+    // c[i] = a[i] op b[i], or NODE_ASSIGN for c[i] = a[i] and c[i] = v
+    NodeKind op;
+    Node *dst;
+    Node *src1;
+    Node *src2;
+    Node *fill;    // v: NODE_NUM or NODE_VAR
+
+    // s = s + a[i] or s += a[i]
+    Var *acc;
+
+    int size;      // Element size in bytes
+};
+
+static bool is_var(Node *node, Var *var) {
+    return node->kind == NODE_VAR && node->var == var;
+}
+
+static bool is_num(Node *node, int val) {
+    return node->kind == NODE_NUM && node->val == val;
+}
+
+// Scalars we keep in registers or re-read must not be reachable through
+// pointers stored to by the loop body.
+static bool is_plain_int_var(Node *node) {
+    return node->kind == NODE_VAR && is_integer(node->ty)
+        && !node->var->is_global && !node->var->is_address_taken;
+}
+
+// Returns the array or pointer variable x if |node| is x[iv] and x has
+// elements of |size| bytes, or NULL. The parser lowers x[iv] to
+// *(x + iv * sizeof(*x)).
+static Node *match_element(Node *node, Var *iv, int size) {
+    if (node->kind != NODE_DEREFERENCE || !is_integer(node->ty)
+        || node->ty->size != size) {
+        return NULL;
+    }
+    Node *add = node->lhs;
+    if (add->kind != NODE_ADD || add->lhs->kind != NODE_VAR) {
+        return NULL;
+    }
+    // A pointer whose address escapes could be redirected by the loop.
+    Var *var = add->lhs->var;
+    if (add->lhs->ty->kind == TY_PTR
+        && (var->is_global || var->is_address_taken)) {
+        return NULL;
+    }
+    Node *scale = add->rhs;
+    if (scale->kind != NODE_MUL || !is_var(scale->lhs, iv)
+        || !is_num(scale->rhs, size)) {
+        return NULL;
+    }
+    return add->lhs;
+}
+
+static bool match_loop(Node *node, Loop *loop) {
+    // i < n
+    Node *cond = node->cond;
+    if (!cond || cond->kind != NODE_LT || !is_plain_int_var(cond->lhs)) {
+        return false;
+    }
+    loop->iv = cond->lhs->var;
+    loop->bound = cond->rhs;
+    if (loop->bound->kind != NODE_NUM && (!is_plain_int_var(loop->bound)
+        || loop->bound->var == loop->iv)) {
+        return false;
+    }
+
+    // i = i + 1, i += 1, ++i or i++
+    if (!node->inc || var_increment(node->inc->lhs, loop->iv) != 1) {
+        return false;
+    }
+
+    // The body must be a single assignment.
+    Node *body = node->then;
+    if (body->kind == NODE_BLOCK) {
+        if (!body->body || body->body->next) {
+            return false;
+        }
+        body = body->body;
+    }
+    if (body->kind != NODE_EXPR_STATEMENT) {
+        return false;
+    }
+    NodeKind kind = body->lhs->kind;
+    if (kind != NODE_ASSIGN && kind != NODE_ADD_ASSIGN) {
+        return false;
+    }
+    Node *lhs = body->lhs->lhs;
+    Node *rhs = body->lhs->rhs;
+
+    // s = s + a[i], s = a[i] + s or s += a[i]
+    if (is_plain_int_var(lhs) && lhs->var != loop->iv
+        && !(loop->bound->kind == NODE_VAR && loop->bound->var == lhs->var)
+        && (kind == NODE_ADD_ASSIGN || rhs->kind == NODE_ADD)) {
+        Node *elem = rhs;
+        if (kind == NODE_ASSIGN) {
+            elem = is_var(rhs->lhs, lhs->var) ? rhs->rhs : rhs->lhs;
+            Node *other = elem == rhs->rhs ? rhs->lhs : rhs->rhs;
+            if (!is_var(other, lhs->var)) {
+                return false;
+            }
+        }
+        // The lanes wrap exactly like s does only if they are as wide.
+        loop->size = lhs->ty->size;
+        loop->src1 = match_element(elem, loop->iv, loop->size);
+        loop->acc = lhs->var;
+        return loop->src1 != NULL;
+    }
+
+    if (kind != NODE_ASSIGN) {
+        return false;
+    }
+    loop->size = lhs->ty->size;
+    loop->dst = match_element(lhs, loop->iv, loop->size);
+
+    // c[i] = v or c[i] = a[i]
+    if (rhs->kind == NODE_NUM
+        || (is_plain_int_var(rhs) && rhs->var != loop->iv)) {
+        loop->op = NODE_ASSIGN;
+        loop->fill = rhs;
+        return loop->dst != NULL;
+    }
+    if (rhs->kind == NODE_DEREFERENCE) {
+        loop->op = NODE_ASSIGN;
+        loop->src1 = match_element(rhs, loop->iv, loop->size);
+        return loop->dst && loop->src1;
+    }
+
+    // c[i] = a[i] + b[i] or c[i] = a[i] - b[i]
+    if (rhs->kind != NODE_ADD && rhs->kind != NODE_SUB) {
+        return false;
+    }
+    loop->op = rhs->kind;
+    loop->src1 = match_element(rhs->lhs, loop->iv, loop->size);
+    loop->src2 = match_element(rhs->rhs, loop->iv, loop->size);
+    return loop->dst && loop->src1 && loop->src2;
+}
+
+// The suffixes of string and SIMD instructions by element size.
+static char suffix[] = { 0, 'b', 'w', 0, 'd', 0, 0, 0, 'q' };
+
+static char *ptr_size(int size) {
+    if (size == 1)
+        return "byte";
+    if (size == 2)
+        return "word";
+    if (size == 4)
+        return "dword";
+    return "qword";
+}
+
+// Returns the low |size| bytes of RAX.
+static char *sized_rax(int size) {
+    if (size == 1)
+        return "al";
+    if (size == 2)
+        return "ax";
+    if (size == 4)
+        return "eax";
+    return "rax";
+}
+
+// Loads the integer variable |var| sign-extended into the 64-bit |r|.
+static void load_int(Var *var, char *r) {
+    int size = var->ty->size;
+    if (size == 8) {
+        emit("  mov %s, [rbp-%d]\n", r, var->offset);
+    }
+    else {
+        emit("  %s %s, %s ptr [rbp-%d]\n", size == 4 ? "movsxd" : "movsx",
+            r, ptr_size(size), var->offset);
+    }
+}
+
+// Loads the address of the first element of |node| into |r|.
+static void load_base(Node *node, char *r) {
+    char *insn = node->ty->kind == TY_ARRAY ? "lea" : "mov";
+    if (node->var->is_global) {
+        emit("  %s %s, [rip+.L.global.%s]\n", insn, r, node->var->name);
+    }
+    else {
+        emit("  %s %s, [rbp-%d]\n", insn, r, node->var->offset);
+    }
+}
+
+// Distinct arrays never overlap, and reading and writing the same
+// variable at the same index is always fine.
+static bool may_alias(Node *dst, Node *src) {
+    if (dst->var == src->var) {
+        return false;
+    }
+    return dst->ty->kind != TY_ARRAY || src->ty->kind != TY_ARRAY;
+}
+
+// Falls back to the scalar loop if a store to dst[i] would be observed by
+// a later load of src[j] (i < j < i + width) within the same vector.
+static void generate_alias_check(Node *dst, Node *src, int vector_size,
+    char *funcname, int seq, int idx) {
+    if (!may_alias(dst, src)) {
+        return;
+    }
+    load_base(dst, "rax");
+    load_base(src, "rdx");
+    emit("  sub rax, rdx\n");
+    emit("  cmp rax, 0\n");
+    emit("  jle .L.vcheck.%s.%d.%d\n", funcname, seq, idx);
+    emit("  cmp rax, %d\n", vector_size);
+    emit("  jl  .L.begin.%s.%d\n", funcname, seq);
+    emit(".L.vcheck.%s.%d.%d:\n", funcname, seq, idx);
+}
+
+// Emits a vectorized prologue loop for |node| if it matches one of the
+// supported patterns. The caller emits the scalar loop at
+// .L.begin.|funcname|.|seq| right after this, which finishes whatever
+// iterations remain.
+bool vectorize_loop(Node *node, char *funcname, int seq) {
+    // Fills and copies are generate_loop_idiom()'s.
+    Loop loop = {0};
+    if (!match_loop(node, &loop) || loop.op == NODE_ASSIGN) {
+        return false;
+    }
+
+    int size = loop.size;
+    int vector_size = opt_avx2 ? 32 : 16;
+    int width = vector_size / size;
+    char *v0 = opt_avx2 ? "ymm0" : "xmm0";
+    char *v1 = opt_avx2 ? "ymm1" : "xmm1";
+    char *acc = opt_avx2 ? "ymm2" : "xmm2";
+
+    if (loop.dst) {
+        generate_alias_check(
+            loop.dst, loop.src1, vector_size, funcname, seq, 1);
+        generate_alias_check(
+            loop.dst, loop.src2, vector_size, funcname, seq, 2);
+    }
+    else if (opt_avx2) {
+        emit("  vpxor %s, %s, %s\n", acc, acc, acc);
+    }
+    else {
+        emit("  pxor %s, %s\n", acc, acc);
+    }
+
+    // Run while i + width <= n.
+    emit(".L.vbegin.%s.%d:\n", funcname, seq);
+    load_int(loop.iv, "rcx");
+    emit("  lea rax, [rcx+%d]\n", width);
+    if (loop.bound->kind == NODE_NUM) {
+        emit("  mov rdx, %d\n", loop.bound->val);
+    }
+    else {
+        load_int(loop.bound->var, "rdx");
+    }
+    emit("  cmp rax, rdx\n");
+    emit("  jg  .L.vend.%s.%d\n", funcname, seq);
+
+    char *mov = opt_avx2 ? "vmovdqu" : "movdqu";
+    load_base(loop.src1, "rsi");
+    emit("  %s %s, [rsi+rcx*%d]\n", mov, v0, size);
+    if (loop.dst) {
+        char *op = loop.op == NODE_ADD ? "padd" : "psub";
+        load_base(loop.src2, "rsi");
+        emit("  %s %s, [rsi+rcx*%d]\n", mov, v1, size);
+        if (opt_avx2) {
+            emit("  v%s%c %s, %s, %s\n", op, suffix[size], v0, v0, v1);
+        }
+        else {
+            emit("  %s%c %s, %s\n", op, suffix[size], v0, v1);
+        }
+        load_base(loop.dst, "rsi");
+        emit("  %s [rsi+rcx*%d], %s\n", mov, size, v0);
+    }
+    else if (opt_avx2) {
+        emit("  vpadd%c %s, %s, %s\n", suffix[size], acc, acc, v0);
+    }
+    else {
+        emit("  padd%c %s, %s\n", suffix[size], acc, v0);
+    }
+    emit("  mov [rbp-%d], %s\n",
+        loop.iv->offset, sized_rax(loop.iv->ty->size));
+    emit("  jmp .L.vbegin.%s.%d\n", funcname, seq);
+    emit(".L.vend.%s.%d:\n", funcname, seq);
+
+    if (loop.acc) {
+        // Sum the lanes of the accumulator into s.
+        if (opt_avx2) {
+            emit("  vextracti128 xmm0, ymm2, 1\n");
+            emit("  vpadd%c xmm2, xmm2, xmm0\n", suffix[size]);
+        }
+        for (int shift = 8; shift >= size; shift /= 2) {
+            emit("  movdqa xmm0, xmm2\n");
+            emit("  psrldq xmm0, %d\n", shift);
+            emit("  padd%c xmm2, xmm0\n", suffix[size]);
+        }
+        emit("  movq rax, xmm2\n");
+        emit("  add [rbp-%d], %s\n", loop.acc->offset, sized_rax(size));
+    }
+    if (opt_avx2) {
+        emit("  vzeroupper\n");
+    }
+    return true;
+}
+
+// Runs all iterations of |node| as one rep stos or rep movs if it fills or
+// copies an array, and sets i to n, so that the scalar loop the caller
+// emits at .L.begin.|funcname|.|seq| right after this exits at once. Unlike
+// memcpy, rep movs copies one element at a time in ascending order, just
+// like the loop, so overlapping operands need no alias check.
+bool generate_loop_idiom(Node *node, char *funcname, int seq) {
+    Loop loop = {0};
+    if (!match_loop(node, &loop) || loop.op != NODE_ASSIGN) {
+        return false;
+    }
+
+    // Skip to the scalar loop unless there are n - i > 0 iterations.
+    int size = loop.size;
+    load_int(loop.iv, "rdx");
+    if (loop.bound->kind == NODE_NUM) {
+        emit("  mov rax, %d\n", loop.bound->val);
+    }
+    else {
+        load_int(loop.bound->var, "rax");
+    }
+    emit("  mov rcx, rax\n");
+    emit("  sub rcx, rdx\n");
+    emit("  jle .L.begin.%s.%d\n", funcname, seq);
+    emit("  mov [rbp-%d], %s\n",
+        loop.iv->offset, sized_rax(loop.iv->ty->size));
+
+    load_base(loop.dst, "rdi");
+    emit("  lea rdi, [rdi+rdx*%d]\n", size);
+    if (loop.fill) {
+        if (loop.fill->kind == NODE_NUM) {
+            emit("  mov rax, %d\n", loop.fill->val);
+        }
+        else {
+            load_int(loop.fill->var, "rax");
+        }
+        emit("  rep stos%c\n", suffix[size]);
+    }
+    else {
+        load_base(loop.src1, "rsi");
+        emit("  lea rsi, [rsi+rdx*%d]\n", size);
+        emit("  rep movs%c\n", suffix[size]);
+    }
+    return true;
+}
@@ -1,7 +1,10 @@
+#define _DEFAULT_SOURCE
 #include <assert.h>
 #include <ctype.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,27 +30,51 @@ struct Token {
     int val; // If kind is TOKEN_NUM, it's assigned
     char *token_string;
     size_t token_length;
+    int line; // Line number in the input, from 1
+};
+
+// While an ErrorTrap is set on a thread, errors on that thread are written
+// to |msg| and jump back to |env| instead of exiting.
+typedef struct ErrorTrap ErrorTrap;
+struct ErrorTrap {
+    jmp_buf env;
+    char *msg;
 };
 
 void error(char *fmt, ...);
 void error_tok(Token *tok, char *fmt, ...);
+char *get_current_input(void);
+void set_input_name(char *input, char *name);
+char *get_input_name(char *input);
+void set_error_trap(ErrorTrap *trap, char *input);
+void report_trapped_error(ErrorTrap *trap);
 bool equal(Token *tok, char *s);
 Token *skip(Token *tok, char *s);
 bool consume(Token **rest, Token *tok, char *str);
 Token *tokenize(char *p);
+typedef struct TokenStream TokenStream;
+TokenStream *tokenize_async(char *p);
+Token *next_tokens(TokenStream *s);
+void release_tokens(TokenStream *s, Token *tok);
 void print_all_token(Token *head);
 
 //
 // parse.c
 //
 
-// Local variable
+// Local or global variable
 typedef struct Var Var;
 struct Var {
     Var *next;
     char *name; // Variable name
     Type *ty;   // Type
     int offset; // Offset from RBP
+    bool is_address_taken; // Whether "&var" appears in the function
+
+    // Global variable
+    bool is_global;
+    bool is_const;         // Read-only, in .rodata
+    char *init_data;       // Initial contents, or NULL for all zeros
 };
 
 // AST node
@@ -56,19 +83,32 @@ typedef enum {
     NODE_SUB,             // -
     NODE_MUL,             // *
     NODE_DIV,             // /
+    NODE_MOD,             // %
     NODE_EQ,              // ==
     NODE_NE,              // !=
     NODE_LT,              // <
     NODE_LE,              // <=
     NODE_GT,              // >
     NODE_GE,              // >=
+    NODE_LOGAND,          // &&
+    NODE_LOGOR,           // ||
+    NODE_NOT,             // !
     NODE_ASSIGN,          // =
+    NODE_ADD_ASSIGN,      // += or prefix ++
+    NODE_SUB_ASSIGN,      // -= or prefix --
+    NODE_MUL_ASSIGN,      // *=
+    NODE_DIV_ASSIGN,      // /=
+    NODE_POST_INC,        // postfix ++
+    NODE_POST_DEC,        // postfix --
     NODE_ADDRESS,         // unary &
     NODE_DEREFERENCE,     // unary *
     NODE_RETURN,          // return
     NODE_IF,              // if
     NODE_FOR,             // for or while
     NODE_BLOCK,           // { ... }
+    NODE_SWITCH,          // switch
+    NODE_CASE,            // case or default label
+    NODE_BREAK,           // break
     NODE_FUNCTION_CALL,   // Function call
     NODE_EXPR_STATEMENT,  // Expression statement
     NODE_VAR,             // Variable
@@ -96,36 +136,58 @@ struct Node {
     // Code block
     Node *body;
 
+    // "switch" statement
+    Node **cases;       // Its case labels, sorted by value
+    int ncases;
+    Node *default_case;
+    Node *case_next;    // Next case label of the same switch, while parsing
+    int case_id;        // Number of a case label in its switch, -1 for
+                        // default
+
     // Function call
     char *funcname;
     Node *args;
 
     Var *var;      // Used if kind == NODE_VAR
     int val;       // Used if kind == NODE_NUM
+
+    int counter;   // First profile counter of an if or for statement
 };
 
 
+// A top-level definition: a function, or a global variable if |var| is set.
 typedef struct Function Function;
 struct Function {
     Function *next;
     char *name;
+    Var *var;
     Var *params;
 
     Node *node;
     Var *locals;
     int stack_size;
+
+    // Compilation cache
+    char *cache_key;    // Where to store the generated code
+    char *cached_asm;   // Code found in the cache, instead of |node|
+
+    int ncounters;      // Profile counters, with -fprofile-generate
 };
-Function *parse(Token *tok);
+Function *parse(Token *tok, int nthreads);
+void parse_stream(TokenStream *s, void (*callback)(Function *fn, void *arg),
+    void *arg, bool free_functions);
 
 //
 // type.c
 //
 
-typedef enum { TY_INT, TY_PTR, TY_FUNC, TY_ARRAY } TypeKind;
+typedef enum { TY_CHAR, TY_SHORT, TY_INT, TY_LONG, TY_PTR, TY_FUNC, TY_ARRAY }
+    TypeKind;
 
 struct Type {
     TypeKind kind;
     int size;      // sizeof() value
+    int align;     // alignment
     // Pointer or array
     Type *base;
 
@@ -141,7 +203,10 @@ struct Type {
     Type *next;
 };
 
+extern Type *ty_char;
+extern Type *ty_short;
 extern Type *ty_int;
+extern Type *ty_long;
 
 bool is_integer(Type *ty);
 Type *copy_type(Type *ty);
@@ -151,8 +216,132 @@ Type *array_of(Type *base, int size);
 void add_type(Node *node);
 
 
+//
+// arena.c
+//
+
+typedef struct Arena Arena;
+Arena *new_arena(void);
+void free_arena(Arena *arena);
+void reset_arena(Arena *arena);
+Arena *use_arena(Arena *arena);
+void *arena_calloc(size_t nmemb, size_t size);
+
+//
+// cache.c
+//
+
+extern char *cache_dir;
+extern long cache_max_size;
+char *cache_key(void *data, size_t len);
+char *cache_lookup(char *key);
+void cache_store(char *key, char *text, size_t len);
+void print_cache_stats(FILE *out);
+
+//
+// profile.c
+//
+
+typedef struct Profile Profile;
+char *profile_path(char *arg);
+int assign_counters(Function *fn);
+Profile *load_profile(char *path);
+long *find_profile(Profile *prof, Function *fn, int ncounters);
+
+//
+// frame.c
+//
+
+void layout_frame(Function *fn);
+
 //
 // codegen.c
 //
 
-void codegen(Function *prog);
+void emit(char *fmt, ...);
+int var_increment(Node *node, Var *var);
+void codegen_begin(FILE *out);
+void codegen_function(Function *fn);
+void codegen(Function *prog, FILE *out, int nthreads);
+
+//
+// vectorize.c
+//
+
+bool vectorize_loop(Node *node, char *funcname, int seq);
+bool generate_loop_idiom(Node *node, char *funcname, int seq);
+
+//
+// assemble.c
+//
+
+void assemble(char *src, char *path);
+void assemble_to(char *src, FILE *out);
+int jit_run(char *src);
+
+//
+// batch.c
+//
+
+void compile_batch(char *manifest_path, FILE *out);
+
+//
+// stats.c
+//
+
+typedef enum {
+    PHASE_NONE,
+    PHASE_TOKENIZE,
+    PHASE_PARSE,
+    PHASE_ADD_TYPE,
+    PHASE_LAYOUT,
+    PHASE_CODEGEN,
+    NPHASES,
+} Phase;
+
+extern bool opt_stats;
+void start_stats(void);
+Phase enter_phase(Phase phase);
+void count_allocation(size_t size);
+void count_token(void);
+void count_node(NodeKind kind);
+long count_instructions(char *text);
+void record_function_stats(char *name, long instructions);
+void print_stats(FILE *out);
+
+//
+// server.c
+//
+
+void run_server(char *path, int nthreads);
+int run_client(char *path, char **args, int nargs);
+
+//
+// main.c
+//
+
+extern _Thread_local bool opt_avx2;
+extern _Thread_local int opt_unroll_factor;
+extern _Thread_local bool opt_stack_coloring;
+extern _Thread_local char *opt_profile_generate;
+extern _Thread_local Profile *opt_profile_use;
+extern _Thread_local bool opt_line_tables;
+
+typedef struct CodegenOptions CodegenOptions;
+struct CodegenOptions {
+    bool avx2;
+    int unroll_factor;
+    bool stack_coloring;
+    char *profile_generate;
+    Profile *profile_use;
+    bool line_tables;
+};
+
+void reset_codegen_options(void);
+CodegenOptions save_codegen_options(void);
+void restore_codegen_options(CodegenOptions opts);
+bool parse_codegen_option(char *arg);
+void check_codegen_options(char *prog, bool emit_object, bool run,
+    bool stream);
+char *read_file(char *path);
+bool is_source_file(char *arg);